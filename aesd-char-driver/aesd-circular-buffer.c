@@ -78,3 +78,236 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
+
+/**
+* Fills @param stats with the occupancy of @param buffer.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_get_stats(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (uint8_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+	{
+		const struct aesd_buffer_entry *e = &buffer->entry[i];
+		if (e->buffptr == NULL)
+			continue;
+		stats->entries++;
+		stats->bytes += e->size;
+		if (e->compressed_size != 0)
+		{
+			stats->compressed_entries++;
+			stats->stored_bytes += e->compressed_size;
+		}
+		else
+			stats->stored_bytes += e->size;
+	}
+	stats->ratio_percent = stats->stored_bytes == 0 ? 100 : (unsigned int) (stats->bytes * 100 / stats->stored_bytes);
+}
+
+/*
+ * A self-contained LZ4 block codec, so that the same code runs in the driver and in user space.
+ * The compressor is the greedy single-probe one of the reference implementation: enough for repetitive text lines.
+ * The decompressor checks every length and offset against its buffers, since a corrupted entry must not overrun them.
+ */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5 // the last 5 bytes are always literals
+#define LZ4_MFLIMIT 12 // no match starts within the last 12 bytes
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_BITS 12
+
+static uint32_t lz4_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length continuation after a 15 in the token. Returns NULL if it does not fit before @param end
+static uint8_t *lz4_put_length(uint8_t *op, const uint8_t *end, size_t len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= end)
+		return NULL;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+// Write one sequence: @param lit_len literals from @param lit, then, if @param match_len is not 0, the match
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *end, const uint8_t *lit, size_t lit_len,
+            size_t offset, size_t match_len)
+{
+	if (op >= end)
+		return NULL;
+	uint8_t *token = op++;
+	*token = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+	if (lit_len >= 15 && (op = lz4_put_length(op, end, lit_len - 15)) == NULL)
+		return NULL;
+	if ((size_t) (end - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0)
+		return op;
+	if (end - op < 2)
+		return NULL;
+	*op++ = (uint8_t) offset;
+	*op++ = (uint8_t) (offset >> 8);
+	match_len -= LZ4_MINMATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15)
+		op = lz4_put_length(op, end, match_len - 15);
+	return op;
+}
+
+/**
+* Compresses the @param size bytes at @param src into an LZ4 block at @param dst, of @param dst_capacity bytes,
+* using the AESD_LZ4_WORKMEM bytes at @param workmem as scratch memory.
+* @return the length of the block, or 0 if it would not be shorter than @param size or not fit: store the entry as is.
+*/
+size_t aesd_circular_buffer_compress(const char *src, size_t size, char *dst, size_t dst_capacity,
+            void *workmem)
+{
+	const uint8_t *base = (const uint8_t *) src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base; // first byte not yet emitted
+	const uint8_t *iend = base + size;
+	const uint8_t *mflimit = iend - (size < LZ4_MFLIMIT ? size : LZ4_MFLIMIT);
+	uint8_t *op = (uint8_t *) dst;
+	uint8_t *oend = op + (dst_capacity < size ? dst_capacity : size); // not shorter is no use
+	uint32_t *table = (uint32_t *) workmem; // position of the last 4 bytes seen with each hash
+
+	if ((uint64_t) size > 0xffffffffULL)
+		return 0;
+	memset(table, 0, AESD_LZ4_WORKMEM);
+	while (size >= LZ4_MFLIMIT + 1 && ip < mflimit)
+	{
+		uint32_t v = lz4_read32(ip);
+		uint32_t h = lz4_hash(v);
+		const uint8_t *ref = base + table[h];
+		table[h] = (uint32_t) (ip - base);
+		if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || lz4_read32(ref) != v)
+		{
+			ip++;
+			continue;
+		}
+		// Extend the match backwards over pending literals, then forwards up to the last literals
+		while (ip > anchor && ref > base && ip[-1] == ref[-1])
+		{
+			ip--;
+			ref--;
+		}
+		const uint8_t *mend = ip + LZ4_MINMATCH;
+		const uint8_t *r = ref + LZ4_MINMATCH;
+		while (mend < iend - LZ4_LASTLITERALS && *mend == *r)
+		{
+			mend++;
+			r++;
+		}
+		op = lz4_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip);
+		if (op == NULL)
+			return 0;
+		// Index a position inside the match too, so that the next repetition of a line is found right away
+		if (mend - 2 > ip)
+			table[lz4_hash(lz4_read32(mend - 2))] = (uint32_t) (mend - 2 - base);
+		ip = anchor = mend;
+	}
+	op = lz4_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL || op >= oend)
+		return 0;
+	return op - (uint8_t *) dst;
+}
+
+// Decompress the LZ4 block of @param src_len bytes at @param src into exactly @param size bytes at @param dst
+static bool lz4_decompress(const uint8_t *ip, size_t src_len, uint8_t *dst, size_t size)
+{
+	const uint8_t *iend = ip + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + size;
+	while (ip < iend)
+	{
+		uint8_t token = *ip++;
+		size_t len = token >> 4;
+		if (len == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= iend)
+					return false;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if ((size_t) (iend - ip) < len || (size_t) (oend - op) < len)
+			return false;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+		if (ip == iend)
+			break; // the last sequence has no match
+		if (iend - ip < 2)
+			return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - dst))
+			return false;
+		len = token & 15;
+		if (len == 15)
+		{
+			uint8_t b;
+			do
+			{
+				if (ip >= iend)
+					return false;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ4_MINMATCH;
+		if ((size_t) (oend - op) < len)
+			return false;
+		const uint8_t *ref = op - offset;
+		while (len-- > 0)
+			*op++ = *ref++; // byte by byte: the match may overlap what it produces
+	}
+	return op == oend;
+}
+
+/**
+* Copies up to @param count bytes of @param entry, starting @param offset bytes into its uncompressed content,
+* to @param dst. For a compressed entry read from a non zero @param offset or short of its end, @param scratch must
+* point to entry->size bytes to decompress into; otherwise it may be NULL.
+* @return the number of bytes copied, 0 if the compressed entry is corrupt.
+*/
+size_t aesd_circular_buffer_entry_read(const struct aesd_buffer_entry *entry, size_t offset, char *dst,
+            size_t count, char *scratch)
+{
+	if (offset >= entry->size)
+		return 0;
+	if (count > entry->size - offset)
+		count = entry->size - offset;
+	if (entry->compressed_size == 0)
+	{
+		memcpy(dst, entry->buffptr + offset, count);
+		return count;
+	}
+	if (offset == 0 && count == entry->size)
+		return lz4_decompress((const uint8_t *) entry->buffptr, entry->compressed_size, (uint8_t *) dst,
+			entry->size) ? count : 0;
+	if (scratch == NULL || lz4_decompress((const uint8_t *) entry->buffptr, entry->compressed_size,
+			(uint8_t *) scratch, entry->size) == false)
+		return 0;
+	memcpy(dst, scratch + offset, count);
+	return count;
+}
@@ -25,9 +25,14 @@ struct aesd_buffer_entry
      */
     const char *buffptr;
     /**
-     * Number of bytes stored in buffptr
+     * Number of bytes the entry holds, uncompressed. Offsets into the buffer are always in these bytes
      */
     size_t size;
+    /**
+     * 0 when buffptr holds the size bytes as is, else the length of the LZ4 block at buffptr that decompresses to them.
+     * Read compressed entries with aesd_circular_buffer_entry_read
+     */
+    size_t compressed_size;
 };
 
 struct aesd_circular_buffer
@@ -58,6 +63,37 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * Occupancy of a circular buffer, see aesd_circular_buffer_get_stats
+ */
+struct aesd_circular_buffer_stats
+{
+    uint8_t entries; /* entries in use */
+    uint8_t compressed_entries; /* of which stored LZ4 compressed */
+    size_t bytes; /* bytes held, uncompressed */
+    size_t stored_bytes; /* bytes actually used at the buffptr of the entries */
+    unsigned int ratio_percent; /* bytes / stored_bytes in percent, 100 when nothing is compressed or held */
+};
+
+extern void aesd_circular_buffer_get_stats(const struct aesd_circular_buffer *buffer,
+            struct aesd_circular_buffer_stats *stats);
+
+/**
+ * Size of the scratch memory aesd_circular_buffer_compress needs. Too large for a kernel stack
+ */
+#define AESD_LZ4_WORKMEM (4096 * sizeof(uint32_t))
+
+/**
+ * Worst case size of the LZ4 block of @param size bytes
+ */
+#define AESD_LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+extern size_t aesd_circular_buffer_compress(const char *src, size_t size, char *dst, size_t dst_capacity,
+            void *workmem);
+
+extern size_t aesd_circular_buffer_entry_read(const struct aesd_buffer_entry *entry, size_t offset, char *dst,
+            size_t count, char *scratch);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
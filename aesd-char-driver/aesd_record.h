@@ -0,0 +1,68 @@
+/*
+ * aesd_record.h
+ *
+ *  @brief Header of the binary records of aesdsocket, shared by the server and the aesdchar driver
+ *
+ * A record is a struct aesd_record followed by `len` bytes of payload, every field little endian. Records travel
+ * as they are: aesdsocket appends them to its store header and all, and the driver keeps each one as one entry.
+ */
+
+#ifndef AESD_RECORD_H
+#define AESD_RECORD_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <asm/byteorder.h>
+#define aesd_le32_to_cpu(x) le32_to_cpu(x)
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+#define aesd_le32_to_cpu(x) le32toh(x)
+#endif
+
+/**
+ * The magic starts with a NUL byte, which a line of text never does: the first byte tells a record from a line
+ */
+#define AESD_RECORD_MAGIC 0x31524100 /* "\0AR1" */
+
+struct aesd_record {
+    /**
+     * AESD_RECORD_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Bytes of payload that follow the header
+     */
+    uint32_t len;
+    /**
+     * Sequence number chosen by the writer. A reply carries the one of the record it answers
+     */
+    uint64_t seq;
+    /**
+     * CLOCK_REALTIME nanoseconds. A record sent with 0 is stamped by aesdsocket when it receives it
+     */
+    uint64_t timestamp_ns;
+};
+
+/**
+ * @return true if the `size` bytes at buf are the start of a record rather than of a line
+ */
+static inline int aesd_record_is_record(const char *buf, size_t size)
+{
+    return size > 0 && buf[0] == '\0';
+}
+
+/**
+ * @return the size of the record, header included, that starts at buf, or 0 while less than its header is there or
+ * when buf does not start with a valid header
+ */
+static inline size_t aesd_record_size(const char *buf, size_t size)
+{
+    const struct aesd_record *rec = (const struct aesd_record *) buf;
+    if (size < sizeof(struct aesd_record) || aesd_le32_to_cpu(rec->magic) != AESD_RECORD_MAGIC)
+        return 0;
+    return sizeof(struct aesd_record) + aesd_le32_to_cpu(rec->len);
+}
+
+#endif /* AESD_RECORD_H */
@@ -0,0 +1,171 @@
+/*
+ * aesdchar-shim.h
+ *
+ * The kernel interfaces main.c uses, implemented in user space, so that the driver builds into the programs of
+ * harness/ and runs under perf, valgrind or a sanitizer without a kernel. Included by main.c instead of the kernel
+ * headers when __KERNEL__ is not defined.
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESDCHAR_SHIM_H_
+#define AESD_CHAR_DRIVER_AESDCHAR_SHIM_H_
+
+#ifdef __KERNEL__
+#error "aesdchar-shim.h is for user space builds only"
+#endif
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Module boilerplate. The extern declarations swallow the semicolon that follows each macro */
+#define THIS_MODULE NULL
+#define MODULE_AUTHOR(author) extern int aesd_shim_module_info
+#define MODULE_LICENSE(license) extern int aesd_shim_module_info
+#define MODULE_PARM_DESC(name, desc) extern int aesd_shim_module_info
+#define module_init(fn) extern int aesd_shim_module_info
+#define module_exit(fn) extern int aesd_shim_module_info
+/* A module parameter gets an accessor, module_param_<name>(), so that a test can set it */
+#define module_param(name, type, perm) type *module_param_##name(void) { return &name; } \
+	extern int aesd_shim_module_info
+
+/* printk */
+#define KERN_EMERG ""
+#define KERN_ALERT ""
+#define KERN_CRIT ""
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_NOTICE ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+/* Memory */
+typedef unsigned int gfp_t;
+#define GFP_KERNEL 0u
+#define __user
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *krealloc(const void *p, size_t size, gfp_t flags)
+{
+	return realloc((void *) p, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *) p);
+}
+
+/* Both return the number of bytes that could not be copied, always 0 here */
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* Semaphores, on POSIX ones so that the sanitizers and valgrind see the synchronization */
+struct semaphore
+{
+	sem_t sem;
+};
+
+static inline void sema_init(struct semaphore *s, int val)
+{
+	sem_init(&s->sem, 0, val);
+}
+
+static inline void down(struct semaphore *s)
+{
+	while (sem_wait(&s->sem) != 0 && errno == EINTR)
+		;
+}
+
+static inline int down_interruptible(struct semaphore *s)
+{
+	return sem_wait(&s->sem) == 0 ? 0 : -EINTR;
+}
+
+static inline void up(struct semaphore *s)
+{
+	sem_post(&s->sem);
+}
+
+/* Files and character devices, only as much as the driver touches. loff_t comes from sys/types.h */
+struct inode
+{
+	dev_t i_rdev;
+};
+
+struct file
+{
+	loff_t f_pos;
+	void *private_data;
+};
+
+struct file_operations
+{
+	void *owner;
+	loff_t (*llseek) (struct file *, loff_t, int);
+	ssize_t (*read) (struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write) (struct file *, const char __user *, size_t, loff_t *);
+	long (*unlocked_ioctl) (struct file *, unsigned int, unsigned long);
+	int (*open) (struct inode *, struct file *);
+	int (*release) (struct inode *, struct file *);
+};
+
+struct cdev
+{
+	void *owner;
+	const struct file_operations *ops;
+};
+
+#define MINORBITS 20
+#define MKDEV(ma, mi) (((dev_t) (ma) << MINORBITS) | (mi))
+#define MAJOR(dev) ((unsigned int) ((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int) ((dev) & ((1U << MINORBITS) - 1)))
+
+static inline int alloc_chrdev_region(dev_t *dev, unsigned baseminor, unsigned count, const char *name)
+{
+	*dev = MKDEV(240, baseminor); // the first major of the range for local use
+	return 0;
+}
+
+static inline void unregister_chrdev_region(dev_t from, unsigned count)
+{
+}
+
+static inline void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	cdev->ops = fops;
+}
+
+static inline int cdev_add(struct cdev *cdev, dev_t dev, unsigned count)
+{
+	return 0;
+}
+
+static inline void cdev_del(struct cdev *cdev)
+{
+}
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_SHIM_H_ */
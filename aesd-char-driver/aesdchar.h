@@ -10,7 +10,9 @@
 
 #include "aesd-circular-buffer.h"
 
+#ifndef AESD_NO_DEBUG // defined by the harness, which measures the driver and not its logging
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
+#endif
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -30,6 +32,7 @@ struct aesd_dev
     struct semaphore lock; // Add lock
 	struct aesd_buffer_entry tmp_kbuf; /* Temporary buffer for unterminated writes ie no '\n' */
 	struct aesd_circular_buffer cbuf; /* The circular buffer itself */
+	char lz4_workmem[AESD_LZ4_WORKMEM]; /* Scratch of the compressor when compress=1, used under lock */
     struct cdev cdev;     /* Char device structure      */
 };
 
@@ -0,0 +1,154 @@
+/**
+ * Round trips through the LZ4 block codec of aesd-circular-buffer.c. Exits with 0 when every test passed
+ */
+#undef NDEBUG // the checks are asserts
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aesd-circular-buffer.h"
+
+static char workmem[AESD_LZ4_WORKMEM];
+static unsigned compressed_cases;
+
+// Compress `size` bytes of src and read them back whole and in parts. Returns the size of the block, 0 when it was
+// kept raw
+static size_t round_trip(const char *name, const char *src, size_t size)
+{
+	size_t cap = AESD_LZ4_COMPRESS_BOUND(size);
+	char *block = malloc(cap + 1);
+	char *out = malloc(size + 1);
+	char *scratch = malloc(size + 1);
+	assert(block != NULL && out != NULL && scratch != NULL);
+	size_t csize = aesd_circular_buffer_compress(src, size, block, cap, workmem);
+	if (csize != 0)
+	{
+		if (csize >= size)
+		{
+			fprintf(stderr, "%s: %zu bytes compressed to %zu\n", name, size, csize);
+			abort();
+		}
+		struct aesd_buffer_entry entry = { .buffptr = block, .size = size, .compressed_size = csize };
+		memset(out, 0x5a, size);
+		if (aesd_circular_buffer_entry_read(&entry, 0, out, size, NULL) != size || memcmp(out, src, size) != 0)
+		{
+			fprintf(stderr, "%s: %zu bytes do not survive the round trip\n", name, size);
+			abort();
+		}
+		// Parts of the entry go through the scratch buffer
+		const size_t offsets[] = { 0, 1, size / 2, size - 1 };
+		for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+		{
+			size_t off = offsets[i];
+			size_t count = (size - off) / 2 + 1;
+			assert(aesd_circular_buffer_entry_read(&entry, off, out, count, scratch) == count);
+			assert(memcmp(out, src + off, count) == 0);
+		}
+		// A truncated block never decodes past the bytes it was given
+		entry.compressed_size = csize / 2;
+		assert(aesd_circular_buffer_entry_read(&entry, 0, out, size, NULL) != size);
+		compressed_cases++;
+	}
+	free(block);
+	free(out);
+	free(scratch);
+	return csize;
+}
+
+static void fill_random(char *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		p[i] = (char) (rand() >> 7);
+}
+
+static void test_incompressible(void)
+{
+	char buf[4096];
+	fill_random(buf, sizeof(buf));
+	assert(round_trip("random", buf, sizeof(buf)) == 0); // no match: kept raw
+}
+
+// Blocks of less than LZ4_MFLIMIT + 1 bytes hold no match and cannot shrink
+static void test_short(void)
+{
+	char buf[16];
+	memset(buf, 'a', sizeof(buf));
+	for (size_t n = 0; n <= 12; n++)
+		assert(round_trip("short run", buf, n) == 0);
+	for (size_t n = 13; n <= sizeof(buf); n++)
+		round_trip("short run", buf, n);
+}
+
+// Literal lengths of 15 and more take extension bytes, 255 each plus the remainder
+static void test_long_literals(void)
+{
+	const size_t runs[] = { 14, 15, 16, 269, 270, 271, 524, 525, 1000 };
+	for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+	{
+		size_t n = runs[i] + 600;
+		char *buf = malloc(n);
+		assert(buf != NULL);
+		fill_random(buf, runs[i]);
+		memset(buf + runs[i], 'x', 600); // a match after the literals, so that the block shrinks
+		assert(round_trip("long literals", buf, n) != 0);
+		free(buf);
+	}
+}
+
+// Matches closer than their own length copy bytes they are still producing
+static void test_overlapping_matches(void)
+{
+	const size_t periods[] = { 1, 2, 3, 7, 8, 9, 15, 16, 17 };
+	for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++)
+	{
+		size_t n = 2000;
+		char *buf = malloc(n);
+		assert(buf != NULL);
+		fill_random(buf, periods[i]);
+		for (size_t j = periods[i]; j < n; j++)
+			buf[j] = buf[j - periods[i]];
+		assert(round_trip("overlapping match", buf, n) != 0);
+		free(buf);
+	}
+}
+
+// Random mixes of literals and back references at any distance and length
+static void test_mixed(void)
+{
+	for (int iter = 0; iter < 500; iter++)
+	{
+		size_t n = 1 + rand() % 20000;
+		char *buf = malloc(n);
+		assert(buf != NULL);
+		size_t pos = 0;
+		while (pos < n)
+		{
+			size_t len = 1 + rand() % (rand() % 2 ? 20 : 400);
+			if (len > n - pos)
+				len = n - pos;
+			if (pos > 0 && rand() % 3 != 0)
+			{
+				size_t dist = 1 + rand() % (pos < 70000 ? pos : 70000);
+				for (size_t j = 0; j < len; j++)
+					buf[pos + j] = buf[pos + j - dist];
+			}
+			else
+				fill_random(buf + pos, len);
+			pos += len;
+		}
+		round_trip("mixed", buf, n);
+		free(buf);
+	}
+}
+
+int main(void)
+{
+	srand(47);
+	test_incompressible();
+	test_short();
+	test_long_literals();
+	test_overlapping_matches();
+	test_mixed();
+	printf("aesd-lz4-test: all tests passed, %u blocks compressed\n", compressed_cases);
+	return 0;
+}
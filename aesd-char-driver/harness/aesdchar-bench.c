@@ -0,0 +1,136 @@
+/**
+ * Throughput of the read and write paths of main.c, built in user space. Run it under perf to see where they spend
+ * their time:
+ *   aesdchar-bench [-t threads] [-n writes per thread] [-s line size] [-r reads per write] [-z]
+ * Every thread writes whole lines and, after each, reads the device back from the start -r times, like aesdsocket
+ * replaying the history after each packet. -z loads the driver with compress=1
+ */
+#include "aesdchar-harness.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static int writes = 100000;
+static int line_size = 64;
+static int reads_per_write = 1;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct result
+{
+	double write_secs;
+	double read_secs;
+	size_t read_bytes;
+};
+
+static void *worker(void *arg)
+{
+	struct result *res = (struct result *) arg;
+	char *line = malloc(line_size);
+	char *buf = malloc(65536);
+	if (line == NULL || buf == NULL)
+		exit(1);
+	struct file filp;
+	harness_open(&filp);
+	for (int i = 0; i < writes; i++)
+	{
+		int n = snprintf(line, line_size, "2026-10-19T12:00:%02d sensor=%d ", i % 60, i % 8);
+		if (n > line_size - 1)
+			n = line_size - 1;
+		memset(line + n, 'v', line_size - 1 - n);
+		line[line_size - 1] = '\n';
+		double t0 = now();
+		if (harness_write(&filp, line, line_size) != line_size)
+			exit(1);
+		double t1 = now();
+		res->write_secs += t1 - t0;
+		for (int r = 0; r < reads_per_write; r++)
+		{
+			struct file rfilp;
+			harness_open(&rfilp);
+			ssize_t got;
+			while ((got = harness_read(&rfilp, buf, 65536)) > 0)
+				res->read_bytes += got;
+			harness_release(&rfilp);
+		}
+		res->read_secs += now() - t1;
+	}
+	harness_release(&filp);
+	free(line);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int threads = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n:s:r:z")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			writes = atoi(optarg);
+			break;
+		case 's':
+			line_size = atoi(optarg);
+			break;
+		case 'r':
+			reads_per_write = atoi(optarg);
+			break;
+		case 'z':
+			*module_param_compress() = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t threads] [-n writes per thread] [-s line size] [-r reads per write] [-z]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || writes < 1 || line_size < 2 || reads_per_write < 0)
+	{
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+	if (aesd_init_module() != 0)
+		return 1;
+	pthread_t *t = calloc(threads, sizeof(pthread_t));
+	struct result *res = calloc(threads, sizeof(struct result));
+	if (t == NULL || res == NULL)
+		return 1;
+	double t0 = now();
+	for (int i = 0; i < threads; i++)
+		if (pthread_create(&t[i], NULL, worker, &res[i]) != 0)
+			return 1;
+	struct result total = { 0 };
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(t[i], NULL);
+		total.write_secs += res[i].write_secs;
+		total.read_secs += res[i].read_secs;
+		total.read_bytes += res[i].read_bytes;
+	}
+	double wall = now() - t0;
+	struct aesd_circular_buffer_stats stats;
+	aesd_circular_buffer_get_stats(&aesd_device.cbuf, &stats);
+	long ops = (long) threads * writes;
+	printf("%d threads, %ld writes of %d bytes%s in %.3f s\n", threads, ops, line_size,
+		*module_param_compress() ? ", compressed" : "", wall);
+	printf("  write: %.0f writes/s, %.2f us per write\n", ops / wall, total.write_secs / ops * 1e6);
+	if (reads_per_write > 0)
+		printf("  read:  %.1f MB/s, %.2f us per replay\n", total.read_bytes / wall / 1e6,
+			total.read_secs / ((double) ops * reads_per_write) * 1e6);
+	printf("  held:  %zu bytes in %zu, ratio %u%%\n", stats.bytes, stats.stored_bytes, stats.ratio_percent);
+	aesd_cleanup_module();
+	free(t);
+	free(res);
+	return 0;
+}
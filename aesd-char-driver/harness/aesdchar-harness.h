@@ -0,0 +1,44 @@
+/*
+ * aesdchar-harness.h
+ *
+ * What the harness programs need to drive main.c from user space
+ */
+
+#ifndef AESD_CHAR_DRIVER_HARNESS_H_
+#define AESD_CHAR_DRIVER_HARNESS_H_
+
+#include "aesdchar-shim.h"
+#include "aesdchar.h"
+
+/* Defined by main.c */
+extern struct aesd_dev aesd_device;
+extern struct file_operations aesd_fops;
+int aesd_init_module(void);
+void aesd_cleanup_module(void);
+bool *module_param_compress(void);
+
+/* Open the device like the VFS would */
+static inline void harness_open(struct file *filp)
+{
+	struct inode inode = { .i_rdev = 0 };
+	memset(filp, 0, sizeof(*filp));
+	aesd_fops.open(&inode, filp);
+}
+
+static inline void harness_release(struct file *filp)
+{
+	struct inode inode = { .i_rdev = 0 };
+	aesd_fops.release(&inode, filp);
+}
+
+static inline ssize_t harness_write(struct file *filp, const char *buf, size_t count)
+{
+	return aesd_fops.write(filp, buf, count, &filp->f_pos);
+}
+
+static inline ssize_t harness_read(struct file *filp, char *buf, size_t count)
+{
+	return aesd_fops.read(filp, buf, count, &filp->f_pos);
+}
+
+#endif /* AESD_CHAR_DRIVER_HARNESS_H_ */
@@ -0,0 +1,253 @@
+/**
+ * Tests of the read and write paths of main.c, built in user space. Exits with 0 when every test passed
+ */
+#undef NDEBUG // the checks are asserts
+#include "aesdchar-harness.h"
+#include "aesd_record.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Everything the device holds, read in chunks of `chunk` bytes from offset 0. Returns a malloc'd string
+static char *read_all(size_t chunk, size_t *len)
+{
+	struct file filp;
+	harness_open(&filp);
+	size_t cap = chunk + 1;
+	char *buf = malloc(cap);
+	assert(buf != NULL);
+	*len = 0;
+	for (;;)
+	{
+		if (*len + chunk + 1 > cap)
+		{
+			cap = (*len + chunk + 1) * 2;
+			buf = realloc(buf, cap);
+			assert(buf != NULL);
+		}
+		ssize_t n = harness_read(&filp, buf + *len, chunk);
+		assert(n >= 0);
+		if (n == 0)
+			break;
+		*len += n;
+	}
+	buf[*len] = '\0';
+	harness_release(&filp);
+	return buf;
+}
+
+static void write_str(const char *s)
+{
+	struct file filp;
+	harness_open(&filp);
+	assert(harness_write(&filp, s, strlen(s)) == (ssize_t) strlen(s));
+	harness_release(&filp);
+}
+
+static void expect(const char *want)
+{
+	static const size_t chunks[] = { 1, 3, 7, 64, 4096 };
+	for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+	{
+		size_t len;
+		char *got = read_all(chunks[i], &len);
+		if (len != strlen(want) || memcmp(got, want, len) != 0)
+		{
+			fprintf(stderr, "read in chunks of %zu: got \"%s\", expected \"%s\"\n", chunks[i], got, want);
+			abort();
+		}
+		free(got);
+	}
+}
+
+static void test_writes(void)
+{
+	assert(aesd_init_module() == 0);
+	expect("");
+	write_str("write1\n");
+	expect("write1\n");
+	write_str("wri");
+	write_str("te2");
+	expect("write1\n"); // not terminated yet
+	write_str("\n");
+	expect("write1\nwrite2\n");
+	aesd_cleanup_module();
+}
+
+static void test_retention(void)
+{
+	assert(aesd_init_module() == 0);
+	char want[256] = "";
+	for (int i = 1; i <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++)
+	{
+		char line[32];
+		snprintf(line, sizeof(line), "write%d\n", i);
+		write_str(line);
+	}
+	for (int i = 4; i <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++)
+		snprintf(want + strlen(want), sizeof(want) - strlen(want), "write%d\n", i);
+	expect(want);
+	aesd_cleanup_module();
+}
+
+static void test_compress(void)
+{
+	*module_param_compress() = true;
+	assert(aesd_init_module() == 0);
+	char want[8192] = "";
+	for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2; i++)
+	{
+		char line[512];
+		int n = snprintf(line, sizeof(line), "2026-10-19 sensor=%d status=OK ", i % 3);
+		while (n < 300)
+			n += snprintf(line + n, sizeof(line) - n, "value=%d ", i);
+		snprintf(line + n, sizeof(line) - n, "\n");
+		write_str(line);
+		if (i >= 2)
+			snprintf(want + strlen(want), sizeof(want) - strlen(want), "%s", line);
+	}
+	write_str("x\n"); // too short to compress
+	snprintf(want + strlen(want), sizeof(want) - strlen(want), "x\n");
+	memmove(want, strchr(want, '\n') + 1, strlen(strchr(want, '\n') + 1) + 1); // one more entry was pushed out
+	expect(want);
+	struct aesd_circular_buffer_stats stats;
+	aesd_circular_buffer_get_stats(&aesd_device.cbuf, &stats);
+	assert(stats.entries == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+	assert(stats.compressed_entries == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1);
+	assert(stats.bytes == strlen(want) && stats.ratio_percent > 300);
+	aesd_cleanup_module();
+	*module_param_compress() = false;
+}
+
+// A record is one entry however it is split across writes, and whatever bytes its payload holds
+static void test_records(void)
+{
+	assert(aesd_init_module() == 0);
+	const char payload[] = { 'a', '\n', '\0', 'b', '\n', 'c' };
+	struct aesd_record rec = { .magic = htole32(AESD_RECORD_MAGIC), .len = htole32(sizeof(payload)),
+		.seq = htole64(7), .timestamp_ns = 0 };
+	struct file filp;
+	harness_open(&filp);
+	assert(harness_write(&filp, (const char *) &rec, 10) == 10); // the header itself may be split
+	assert(harness_write(&filp, (const char *) &rec + 10, sizeof(rec) - 10) == (ssize_t) sizeof(rec) - 10);
+	assert(harness_write(&filp, payload, 2) == 2); // "a\n" does not end the record
+	assert(harness_write(&filp, payload + 2, sizeof(payload) - 2) == (ssize_t) sizeof(payload) - 2);
+	harness_release(&filp);
+	write_str("line\n");
+	size_t len;
+	char *got = read_all(3, &len);
+	assert(len == sizeof(rec) + sizeof(payload) + 5);
+	assert(memcmp(got, &rec, sizeof(rec)) == 0);
+	assert(memcmp(got + sizeof(rec), payload, sizeof(payload)) == 0);
+	assert(memcmp(got + sizeof(rec) + sizeof(payload), "line\n", 5) == 0);
+	free(got);
+	struct aesd_circular_buffer_stats stats;
+	aesd_circular_buffer_get_stats(&aesd_device.cbuf, &stats);
+	assert(stats.entries == 2);
+	aesd_cleanup_module();
+}
+
+/*
+ * Writers append whole lines while readers read the device: every read must see whole lines, at most
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED of them, each writer's in the order it wrote them
+ */
+enum { WRITERS = 4, READERS = 4, LINES = 20000 };
+static atomic_bool writing;
+
+static void *writer(void *arg)
+{
+	int id = (int) (intptr_t) arg;
+	struct file filp;
+	harness_open(&filp);
+	for (int seq = 0; seq < LINES; seq++)
+	{
+		char line[64];
+		int n = snprintf(line, sizeof(line), "w%d:%d:%.*s\n", id, seq, seq % 20, "....................");
+		assert(harness_write(&filp, line, n) == n);
+	}
+	harness_release(&filp);
+	return NULL;
+}
+
+static void check_snapshot(const char *buf, size_t len)
+{
+	int last[WRITERS];
+	int lines = 0;
+	for (int i = 0; i < WRITERS; i++)
+		last[i] = -1;
+	for (const char *p = buf; p < buf + len; )
+	{
+		const char *nl = memchr(p, '\n', buf + len - p);
+		assert(nl != NULL); // whole lines only
+		int id, seq;
+		assert(sscanf(p, "w%d:%d:", &id, &seq) == 2 && id >= 0 && id < WRITERS);
+		assert(seq > last[id]);
+		const char *pad = strchr(strchr(p, ':') + 1, ':') + 1;
+		assert(nl - pad == seq % 20); // the line was not torn or mixed with another
+		last[id] = seq;
+		lines++;
+		p = nl + 1;
+	}
+	assert(lines <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+static void *reader(void *arg)
+{
+	static __thread char buf[65536];
+	long *reads = (long *) arg;
+	while (atomic_load(&writing))
+	{
+		struct file filp;
+		harness_open(&filp);
+		ssize_t n = harness_read(&filp, buf, sizeof(buf)); // one call holds the lock: a consistent snapshot
+		assert(n >= 0);
+		check_snapshot(buf, n);
+		harness_release(&filp);
+		(*reads)++;
+	}
+	return NULL;
+}
+
+static void test_stress(bool compress)
+{
+	*module_param_compress() = compress;
+	assert(aesd_init_module() == 0);
+	pthread_t w[WRITERS], r[READERS];
+	long reads[READERS] = { 0 };
+	atomic_store(&writing, true);
+	for (int i = 0; i < READERS; i++)
+		assert(pthread_create(&r[i], NULL, reader, &reads[i]) == 0);
+	for (int i = 0; i < WRITERS; i++)
+		assert(pthread_create(&w[i], NULL, writer, (void *) (intptr_t) i) == 0);
+	for (int i = 0; i < WRITERS; i++)
+		pthread_join(w[i], NULL);
+	atomic_store(&writing, false);
+	long total = 0;
+	for (int i = 0; i < READERS; i++)
+	{
+		pthread_join(r[i], NULL);
+		total += reads[i];
+	}
+	size_t len;
+	char *all = read_all(4096, &len);
+	check_snapshot(all, len);
+	free(all);
+	struct aesd_circular_buffer_stats stats;
+	aesd_circular_buffer_get_stats(&aesd_device.cbuf, &stats);
+	assert(stats.entries == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+	printf("stress%s: %d writes, %ld concurrent reads\n", compress ? " compressed" : "", WRITERS * LINES, total);
+	aesd_cleanup_module();
+	*module_param_compress() = false;
+}
+
+int main(void)
+{
+	test_writes();
+	test_retention();
+	test_compress();
+	test_records();
+	test_stress(false);
+	test_stress(true);
+	printf("aesdchar-test: all tests passed\n");
+	return 0;
+}
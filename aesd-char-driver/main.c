@@ -11,6 +11,7 @@
  *
  */
 
+#ifdef __KERNEL__
 #include <asm-generic/errno-base.h>
 #include <linux/module.h>
 #include <linux/init.h>
@@ -18,7 +19,13 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#else
+#include "aesdchar-shim.h" // built into the user space harness
+#endif
 #include "aesd-circular-buffer.h"
+#include "aesd_record.h"
 #include "aesdchar.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -26,6 +33,10 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Solomon T");
 MODULE_LICENSE("Dual BSD/GPL");
 
+static bool compress = false;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Keep the retained writes LZ4 compressed");
+
 int aesd_open(struct inode *, struct file *);
 int aesd_open(struct inode *, struct file *);
 ssize_t aesd_read(struct file *, char __user *, size_t, loff_t *);
@@ -50,6 +61,45 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/*
+ * Copy count bytes of ent from offset to dst, decompressing it if it is stored compressed
+ */
+static int aesd_copy_entry(const struct aesd_buffer_entry *ent, size_t offset, char *dst, size_t count)
+{
+	char *scratch = NULL;
+	size_t copied;
+	if (ent->compressed_size != 0 && (offset != 0 || count != ent->size))
+	{
+		scratch = kmalloc(ent->size, GFP_KERNEL);
+		if (scratch == NULL)
+			return -ENOMEM;
+	}
+	copied = aesd_circular_buffer_entry_read(ent, offset, dst, count, scratch);
+	kfree(scratch);
+	return copied == count ? 0 : -EIO;
+}
+
+/*
+ * Swap the kzalloced string of ent for its LZ4 block when that is smaller. Keeps the string otherwise
+ */
+static void aesd_compress_entry(struct aesd_buffer_entry *ent)
+{
+	size_t cap = AESD_LZ4_COMPRESS_BOUND(ent->size);
+	size_t csize;
+	char *cbuf = kmalloc(cap, GFP_KERNEL);
+	if (cbuf == NULL)
+		return;
+	csize = aesd_circular_buffer_compress(ent->buffptr, ent->size, cbuf, cap, aesd_device.lz4_workmem);
+	if (csize == 0)
+	{
+		kfree(cbuf);
+		return;
+	}
+	kfree(ent->buffptr);
+	ent->buffptr = krealloc(cbuf, csize, GFP_KERNEL) ?: cbuf; // shrinking cannot fail, but keep cbuf if it does
+	ent->compressed_size = csize;
+}
+
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
@@ -82,9 +132,14 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
 		retval = 0;
 		goto out;
 	}
-	size_t n = ent->size;
+	size_t n = ent->size - j;
 	size_t n_b_to_cpy = count > n ? n : count; // Copy partial if count < total length of this entry's string
-	memcpy(ret_str, ent->buffptr+j, n_b_to_cpy);
+	int err = aesd_copy_entry(ent, j, ret_str, n_b_to_cpy);
+	if (err != 0)
+	{
+		retval = err;
+		goto out;
+	}
 	i += n_b_to_cpy;
     retval = i;
 	while (i < count)
@@ -97,7 +152,8 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
 		}
 		n = ent->size;
 		n_b_to_cpy = (count - i) > n ? n : (count - i); // Copy partial if (count - i) < total length of this entry's string
-		memcpy(ret_str+i, ent->buffptr, n_b_to_cpy);
+		if (aesd_copy_entry(ent, 0, ret_str+i, n_b_to_cpy) != 0)
+			break; // Return what was copied so far
 		i += n_b_to_cpy;
 		retval = i; // Update the number of characters read
 	}
@@ -135,7 +191,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 	}
 	if (tmp_kbuf->size > 0 && tmp_kbuf->buffptr != NULL)
 	{
-		strcpy(kbuf, tmp_kbuf->buffptr); // Copy the existing string to the new buffer
+		memcpy(kbuf, tmp_kbuf->buffptr, tmp_kbuf->size); // Copy the existing bytes to the new buffer. Records hold NULs
 		kfree(tmp_kbuf->buffptr); // We dont need the existing string buffer anymore
 	}
 	if (copy_from_user(kbuf + tmp_kbuf->size, buf, count) != 0)
@@ -149,12 +205,32 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 	tmp_kbuf->buffptr = kbuf;
 	tmp_kbuf->size += count;
     PDEBUG("write: tmp_kbuf->size = %ld, tmp_kbuf->buffptr =  %s", tmp_kbuf->size, kbuf);
-	bool is_term = (tmp_kbuf->buffptr[tmp_kbuf->size-1] == '\n');
+	// A line ends with '\n'. A record (aesd_record.h) ends after the length in its header, whatever its bytes are
+	size_t rec_size = aesd_record_size(kbuf, tmp_kbuf->size);
+	bool is_term;
+	if (rec_size != 0)
+		is_term = (tmp_kbuf->size >= rec_size);
+	else if (aesd_record_is_record(kbuf, tmp_kbuf->size) && tmp_kbuf->size < sizeof(struct aesd_record))
+		is_term = false; // the rest of the header is still to come
+	else
+		is_term = (tmp_kbuf->buffptr[tmp_kbuf->size-1] == '\n');
 	if (is_term)
 	{
-		// If kbuf ends with '\n' add entry using aesd_circular_buffer_add_entry
+		// If kbuf is a whole line or record add entry using aesd_circular_buffer_add_entry
+		if (compress)
+			aesd_compress_entry(tmp_kbuf); // kbuf is freed if it compresses
+		if (aesd_device.cbuf.full)
+			kfree(aesd_device.cbuf.entry[aesd_device.cbuf.in_offs].buffptr); // the oldest entry is overwritten
 		aesd_circular_buffer_add_entry(&aesd_device.cbuf, tmp_kbuf);
-		PDEBUG("write: ADDED TO CIRC BUF: tmp_kbuf->size = %ld, tmp_kbuf->buffptr =  %s", tmp_kbuf->size, kbuf);
+		PDEBUG("write: ADDED TO CIRC BUF: tmp_kbuf->size = %ld, tmp_kbuf->buffptr =  %s", tmp_kbuf->size,
+			tmp_kbuf->compressed_size != 0 ? "(compressed)" : kbuf);
+		if (compress)
+		{
+			struct aesd_circular_buffer_stats stats;
+			aesd_circular_buffer_get_stats(&aesd_device.cbuf, &stats);
+			PDEBUG("write: %u entries hold %zu bytes in %zu, ratio %u%%", stats.entries, stats.bytes,
+				stats.stored_bytes, stats.ratio_percent);
+		}
 		memset(tmp_kbuf, 0, sizeof(struct aesd_buffer_entry)); // Clear memory after it has been copied over
 		goto out; // No need to clear kbuf
 	}
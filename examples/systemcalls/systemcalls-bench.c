@@ -0,0 +1,81 @@
+/**
+ * Spawn latency of do_exec (posix_spawn) against fork and execv, the way do_exec used to work
+ *
+ * Usage: systemcalls-bench [runs] [ballast MiB]
+ * The parent first touches `ballast` MiB of memory, since the cost of fork grows with the page tables it copies
+ */
+#include "systemcalls.h"
+#include <string.h>
+#include <time.h>
+
+#define BATCH 32
+
+static bool fork_exec(char *const command[])
+{
+	pid_t p = fork();
+	if (p == -1) return false;
+	if (p == 0)
+	{
+		execv(command[0], command);
+		_exit(255);
+	}
+	int stat_loc = 0;
+	if (waitpid(p, &stat_loc, 0) == -1) return false;
+	return WIFEXITED(stat_loc) && WEXITSTATUS(stat_loc) == 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int runs, double secs)
+{
+	printf("%-28s %6d runs %8.1f us/command\n", name, runs, secs * 1e6 / runs);
+}
+
+int main(int argc, char **argv)
+{
+	int runs = argc > 1 ? atoi(argv[1]) : 1000;
+	size_t ballast = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+	char *mem = (char *) malloc(ballast << 20);
+	if (mem != NULL)
+		memset(mem, 1, ballast << 20); // touched, so that it has page table entries to copy
+	printf("parent holds %zu MiB\n", ballast);
+
+	char *const cmd[] = { "/bin/true", NULL };
+	double t0 = now();
+	for (int i = 0; i < runs; i++)
+		fork_exec(cmd);
+	report("fork + execv + waitpid", runs, now() - t0);
+
+	t0 = now();
+	for (int i = 0; i < runs; i++)
+		do_exec(1, "/bin/true");
+	report("do_exec (posix_spawn)", runs, now() - t0);
+
+	t0 = now();
+	for (int i = 0; i < runs; i++)
+		do_exec_redirect("/dev/null", 1, "/bin/true");
+	report("do_exec_redirect", runs, now() - t0);
+
+	struct exec_cmd batch[BATCH];
+	for (int i = 0; i < BATCH; i++)
+	{
+		batch[i].argv = cmd;
+		batch[i].outputfile = NULL;
+	}
+	t0 = now();
+	int done = 0;
+	while (done < runs)
+	{
+		int n = runs - done < BATCH ? runs - done : BATCH;
+		do_exec_batch(batch, n);
+		done += n;
+	}
+	report("do_exec_batch, 32 at a time", runs, now() - t0);
+	free(mem);
+	return 0;
+}
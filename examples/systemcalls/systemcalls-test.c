@@ -0,0 +1,115 @@
+/**
+ * Tests of do_exec_batch. Exits with 0 when every test passed
+ */
+#undef NDEBUG // the checks are asserts
+#include "systemcalls.h"
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+
+static char *const cmd_true[] = { "/bin/true", NULL };
+static char *const cmd_false[] = { "/bin/false", NULL };
+static char *const cmd_exit3[] = { "/bin/sh", "-c", "exit 3", NULL };
+static char *const cmd_slow[] = { "/bin/sh", "-c", "sleep 0.2; exit 5", NULL };
+static char *const cmd_echo[] = { "/bin/echo", "batch", NULL };
+static char *const cmd_missing[] = { "/no/such/command", NULL };
+
+#define OUTPUT_FILE "/tmp/systemcalls-test.txt"
+
+static int exit_code(const struct exec_cmd *c)
+{
+	assert(c->pid > 0 && WIFEXITED(c->status));
+	return WEXITSTATUS(c->status);
+}
+
+// Every child of a batch is reaped by the time it returns
+static void assert_no_child(void)
+{
+	assert(waitpid(-1, NULL, WNOHANG) == -1 && errno == ECHILD);
+}
+
+// The slow command is started first and exits last: each status still lands in its own command
+static void test_mixed_exit_codes(void)
+{
+	struct exec_cmd cmds[] = {
+		{ .argv = cmd_slow }, { .argv = cmd_true }, { .argv = cmd_false }, { .argv = cmd_exit3 },
+		{ .argv = cmd_echo, .outputfile = OUTPUT_FILE },
+	};
+	assert(do_exec_batch(cmds, 5) == false);
+	assert(exit_code(&cmds[0]) == 5);
+	assert(exit_code(&cmds[1]) == 0);
+	assert(exit_code(&cmds[2]) == 1);
+	assert(exit_code(&cmds[3]) == 3);
+	assert(exit_code(&cmds[4]) == 0);
+	char buf[32] = "";
+	FILE *f = fopen(OUTPUT_FILE, "r");
+	assert(f != NULL && fgets(buf, sizeof(buf), f) != NULL);
+	fclose(f);
+	unlink(OUTPUT_FILE);
+	assert(strcmp(buf, "batch\n") == 0);
+
+	struct exec_cmd all_ok[] = { { .argv = cmd_true }, { .argv = cmd_echo, .outputfile = OUTPUT_FILE } };
+	assert(do_exec_batch(all_ok, 2) == true);
+	unlink(OUTPUT_FILE);
+	assert_no_child();
+}
+
+// A command that cannot be started fails the batch, without keeping the others from running
+static void test_spawn_failure(void)
+{
+	struct exec_cmd cmds[] = {
+		{ .argv = cmd_true }, { .argv = cmd_missing }, { .argv = cmd_exit3 },
+		{ .argv = cmd_true, .outputfile = "/no/such/dir/out.txt" },
+	};
+	assert(do_exec_batch(cmds, 4) == false);
+	assert(exit_code(&cmds[0]) == 0);
+	assert(cmds[1].pid == -1 && cmds[1].status == -1);
+	assert(exit_code(&cmds[2]) == 3);
+	assert(cmds[3].pid == -1 && cmds[3].status == -1);
+	assert_no_child();
+}
+
+/*
+ * More commands than there are file descriptors left for their pidfds: the commands without one are reaped with
+ * waitpid once the polled ones are done
+ */
+static void test_larger_than_poll_set(void)
+{
+	enum { N = 100 };
+	struct rlimit saved;
+	assert(getrlimit(RLIMIT_NOFILE, &saved) == 0);
+	struct rlimit low = { .rlim_cur = 32, .rlim_max = saved.rlim_max };
+	assert(setrlimit(RLIMIT_NOFILE, &low) == 0);
+	static char *const *argvs[] = { cmd_true, cmd_false, cmd_exit3 };
+	static const int codes[] = { 0, 1, 3 };
+	struct exec_cmd cmds[N];
+	for (int i = 0; i < N; i++)
+		cmds[i] = (struct exec_cmd) { .argv = argvs[i % 3] };
+	assert(do_exec_batch(cmds, N) == false);
+	for (int i = 0; i < N; i++)
+		assert(exit_code(&cmds[i]) == codes[i % 3]);
+
+	struct exec_cmd all_ok[N];
+	for (int i = 0; i < N; i++)
+		all_ok[i] = (struct exec_cmd) { .argv = cmd_true };
+	assert(do_exec_batch(all_ok, N) == true);
+	assert(setrlimit(RLIMIT_NOFILE, &saved) == 0);
+	assert_no_child();
+}
+
+static void test_empty_batch(void)
+{
+	assert(do_exec_batch(NULL, 0) == true);
+	assert(do_exec_batch(NULL, -1) == false);
+}
+
+int main(void)
+{
+	test_empty_batch();
+	test_mixed_exit_codes();
+	test_spawn_failure();
+	test_larger_than_poll_set();
+	printf("systemcalls-test: all tests passed\n");
+	return 0;
+}
@@ -1,4 +1,54 @@
 #include "systemcalls.h"
+#include <errno.h>
+#include <poll.h> // For poll on pidfds
+#include <sys/syscall.h> // For pidfd_open
+
+extern char **environ;
+
+/**
+ * Start @param command with posix_spawn, with its standard output redirected to @param outputfile unless NULL.
+ * posix_spawn starts the child with CLONE_VM | CLONE_VFORK instead of copying the page tables of the parent, so its
+ * cost does not grow with the size of the caller, and it is safe to call from a multi-threaded process.
+ * A failure to open the output file or to exec is reported by posix_spawn itself.
+ * @return the pid of the child, or -1 if it could not be started.
+ */
+static pid_t spawn_cmd(char *const command[], const char *outputfile)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_t *actions_ptr = NULL;
+	if (outputfile != NULL)
+	{
+		// We want to overwrite existing files, and create a new file if it doesn't exist. rw- r-- r--
+		if (posix_spawn_file_actions_init(&actions) != 0)
+			return -1;
+		actions_ptr = &actions;
+		if (posix_spawn_file_actions_addopen(actions_ptr, STDOUT_FILENO, outputfile, O_CREAT | O_WRONLY | O_TRUNC,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0)
+		{
+			posix_spawn_file_actions_destroy(actions_ptr);
+			return -1;
+		}
+	}
+	pid_t p;
+	int ret = posix_spawn(&p, command[0], actions_ptr, NULL, command, environ);
+	if (actions_ptr != NULL)
+		posix_spawn_file_actions_destroy(actions_ptr);
+	return ret == 0 ? p : -1;
+}
+
+/**
+ * Wait for the child @param p, and for no other child of the process.
+ * @return true if it exited normally with status zero.
+ */
+static bool wait_cmd(pid_t p, int *stat_loc)
+{
+	while (waitpid(p, stat_loc, 0) == -1)
+	{
+		if (errno != EINTR)
+			return false;
+	}
+	return WIFEXITED(*stat_loc) && WEXITSTATUS(*stat_loc) == 0;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -58,23 +108,12 @@ bool do_exec(int count, ...)
  *
 */
 
-	pid_t p = fork();
-	if (p == -1) return false;
-	if (p == 0)
-	{
-		// Child
-		execv(command[0], command);
-		exit(255); // Never reached unless execv returns; which only happens when an error occurs. Child to exit with status 255
-	}
-
-	// Parent
-	int stat_loc = 0;
-	wait(&stat_loc);
+	// posix_spawn instead of fork and execv, see spawn_cmd
     va_end(args);
-	if (WIFEXITED(stat_loc) == true && WEXITSTATUS(stat_loc) == 0)
-		return true; // Child process exited normally and with status zero
-	else
-    	return false; // Child process exited with non-zero
+	pid_t p = spawn_cmd(command, NULL);
+	if (p == -1) return false; // could not be started, or execv failed
+	int stat_loc = 0;
+	return wait_cmd(p, &stat_loc); // Child process exited normally and with status zero
 }
 
 /**
@@ -102,30 +141,73 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *
 */
 
-	pid_t p = fork();
-	if (p == -1) return false;
-	if (p == 0)
+	// The redirect is a file action of posix_spawn: the child opens outputfile as its stdout before execv
+    va_end(args);
+	pid_t p = spawn_cmd(command, outputfile);
+	if (p == -1) return false; // could not be started, outputfile could not be opened, or execv failed
+	int stat_loc = 0;
+	return wait_cmd(p, &stat_loc); // Child process exited with zero
+}
+
+/**
+* @param cmds - @param count commands to run concurrently. Every command is started before any is waited for, and
+*   each is reaped as soon as it exits, through a pidfd (Linux 5.3 and later) or else with waitpid in order.
+*   pid and status of each command are filled in.
+* @return true if every command was started and exited normally with status zero, which an empty batch trivially is.
+*   false for a negative @param count.
+*/
+bool do_exec_batch(struct exec_cmd *cmds, int count)
+{
+	if (count <= 0)
+		return count == 0;
+	bool ok = true;
+	struct pollfd *pfds = (struct pollfd *) malloc(count * sizeof(struct pollfd));
+	if (pfds == NULL)
+		return false;
+	int polling = 0;
+	for (int i = 0; i < count; i++)
 	{
-		// Child
-		int fd = open(outputfile, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); // rw- r-- r--
-		// We want to overwrite existing files, and create a new file if it doesn't exist
-		if (fd == -1)
-			exit(1); // Failed to open file
-		if (dup2(fd, 1) < 0)
+		cmds[i].status = -1;
+		cmds[i].pid = spawn_cmd(cmds[i].argv, cmds[i].outputfile);
+		pfds[i].fd = -1;
+		pfds[i].events = POLLIN;
+		if (cmds[i].pid == -1)
 		{
-			close(fd);
-			exit(1); // Failed to replace stdout with outputfile in the child process
+			ok = false;
+			continue;
 		}
-		execv(command[0], command);
-		exit(1); // Never reached unless execv returns; which only happens when an error occurs. Child to exit with status 1
+#ifdef SYS_pidfd_open
+		pfds[i].fd = (int) syscall(SYS_pidfd_open, cmds[i].pid, 0); // readable once the child exits
+		if (pfds[i].fd != -1)
+			polling++;
+#endif
 	}
-
-	// Parent
-	int stat_loc = 0;
-	wait(&stat_loc);
-    va_end(args);
-	if (WIFEXITED(stat_loc) == true && WEXITSTATUS(stat_loc) == 0)
-		return true; // Child process exited with zero
-	else
-    	return false; // Child process exited with non-zero
+	// Reap in the order the commands exit. A zombie is never left waiting behind a slow command
+	while (polling > 0)
+	{
+		if (poll(pfds, count, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break; // the rest is reaped in order below
+		}
+		for (int i = 0; i < count; i++)
+		{
+			if (pfds[i].fd == -1 || pfds[i].revents == 0)
+				continue;
+			ok = wait_cmd(cmds[i].pid, &cmds[i].status) && ok; // does not block: the child exited
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			polling--;
+		}
+	}
+	for (int i = 0; i < count; i++)
+	{
+		if (pfds[i].fd != -1)
+			close(pfds[i].fd);
+		if (cmds[i].pid != -1 && cmds[i].status == -1)
+			ok = wait_cmd(cmds[i].pid, &cmds[i].status) && ok; // no pidfd
+	}
+	free(pfds);
+	return ok;
 }
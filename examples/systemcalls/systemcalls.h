@@ -5,9 +5,22 @@
 #include <sys/wait.h> // For wait
 #include <unistd.h> // For execv, dup2
 #include <fcntl.h> // For open
+#include <spawn.h> // For posix_spawn
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command of a batch. argv is NULL terminated and argv[0] is the full path to the command
+ */
+struct exec_cmd {
+    char *const *argv;
+    const char *outputfile; // standard output is redirected here unless NULL
+    pid_t pid; // set by do_exec_batch. -1 if the command could not be started
+    int status; // wait status of the command, see WIFEXITED. Set by do_exec_batch
+};
+
+bool do_exec_batch(struct exec_cmd *cmds, int count);
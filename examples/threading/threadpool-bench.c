@@ -0,0 +1,80 @@
+/**
+ * Throughput of threadpool.c against a thread per task, the pattern of start_thread_obtaining_mutex
+ *
+ * Usage: threadpool-bench [tasks] [workers] [work]
+ * Every task spins for `work` iterations (default 100), so that task overhead dominates
+ */
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned long work = 100;
+
+static void *spin(void *arg)
+{
+	volatile unsigned long x = 0;
+	for (unsigned long i = 0; i < work; i++)
+		x += i;
+	return arg;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long tasks, double secs)
+{
+	printf("%-24s %10lu tasks %8.3f s %12.0f tasks/s\n", name, tasks, secs, tasks / secs);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long tasks = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	unsigned workers = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+	work = argc > 3 ? strtoul(argv[3], NULL, 10) : work;
+
+	struct tp_pool *pool = tp_create(workers);
+	if (pool == NULL)
+		return 1;
+	double t0 = now();
+	for (unsigned long i = 0; i < tasks; i++)
+		tp_post(pool, spin, NULL);
+	tp_join_all(pool);
+	report("pool, posted", tasks, now() - t0);
+
+	t0 = now();
+	enum { BATCH = 1024 };
+	struct tp_future *f[BATCH];
+	for (unsigned long i = 0; i < tasks; i += BATCH)
+	{
+		unsigned long n = tasks - i < BATCH ? tasks - i : BATCH;
+		for (unsigned long j = 0; j < n; j++)
+			f[j] = tp_submit(pool, spin, NULL);
+		for (unsigned long j = 0; j < n; j++)
+			tp_future_wait(f[j]);
+	}
+	report("pool, futures", tasks, now() - t0);
+	tp_destroy(pool);
+
+	// A thread per task is far slower: run a tenth of the tasks
+	unsigned long thread_tasks = tasks / 10 > 0 ? tasks / 10 : 1;
+	pthread_t t[BATCH];
+	t0 = now();
+	for (unsigned long i = 0; i < thread_tasks; i += BATCH)
+	{
+		unsigned long n = thread_tasks - i < BATCH ? thread_tasks - i : BATCH;
+		unsigned long started = 0;
+		while (started < n && pthread_create(&t[started], NULL, spin, NULL) == 0)
+			started++;
+		for (unsigned long j = 0; j < started; j++)
+			pthread_join(t[j], NULL);
+	}
+	report("thread per task", thread_tasks, now() - t0);
+	return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * Unit tests of threadpool.c. Exits with 0 when every test passed
+ */
+#include "threadpool.h"
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void *square(void *arg)
+{
+	intptr_t n = (intptr_t) arg;
+	return (void *) (n * n);
+}
+
+static _Atomic long counter;
+
+static void *count(void *arg)
+{
+	atomic_fetch_add(&counter, (long) (intptr_t) arg);
+	return NULL;
+}
+
+static struct tp_pool *fib_pool;
+
+// Each call splits into two tasks and waits for them from inside the pool, which only completes if waiting workers
+// run other tasks meanwhile
+static void *fib(void *arg)
+{
+	intptr_t n = (intptr_t) arg;
+	if (n < 2)
+		return (void *) n;
+	struct tp_future *a = tp_submit(fib_pool, fib, (void *) (n - 1));
+	struct tp_future *b = tp_submit(fib_pool, fib, (void *) (n - 2));
+	assert(a != NULL && b != NULL);
+	return (void *) ((intptr_t) tp_future_wait(a) + (intptr_t) tp_future_wait(b));
+}
+
+// Posts `n` more tasks from inside the pool, so that tp_join_all has to wait for tasks it never saw submitted
+static void *fan_out(void *arg)
+{
+	for (intptr_t i = 0; i < (intptr_t) arg; i++)
+		assert(tp_post(fib_pool, count, (void *) 1));
+	return NULL;
+}
+
+static void test_futures(unsigned workers)
+{
+	struct tp_pool *pool = tp_create(workers);
+	assert(pool != NULL);
+	enum { N = 10000 };
+	static struct tp_future *f[N];
+	for (intptr_t i = 0; i < N; i++)
+	{
+		f[i] = tp_submit(pool, square, (void *) i);
+		assert(f[i] != NULL);
+	}
+	for (intptr_t i = 0; i < N; i++)
+		assert((intptr_t) tp_future_wait(f[i]) == i * i);
+	tp_destroy(pool);
+}
+
+static void test_join_all(unsigned workers)
+{
+	struct tp_pool *pool = tp_create(workers);
+	assert(pool != NULL);
+	atomic_store(&counter, 0);
+	for (int i = 0; i < 100000; i++)
+		assert(tp_post(pool, count, (void *) 1));
+	tp_join_all(pool);
+	assert(atomic_load(&counter) == 100000);
+	// The pool is still usable after a join
+	assert(tp_post(pool, count, (void *) 5));
+	tp_join_all(pool);
+	assert(atomic_load(&counter) == 100005);
+	tp_destroy(pool);
+}
+
+static void test_nested(unsigned workers)
+{
+	fib_pool = tp_create(workers);
+	assert(fib_pool != NULL);
+	struct tp_future *f = tp_submit(fib_pool, fib, (void *) 20);
+	assert((intptr_t) tp_future_wait(f) == 6765);
+
+	atomic_store(&counter, 0);
+	for (int i = 0; i < 100; i++)
+		assert(tp_post(fib_pool, fan_out, (void *) 1000)); // more tasks than a deque holds at first: it grows
+	tp_join_all(fib_pool);
+	assert(atomic_load(&counter) == 100000);
+	tp_destroy(fib_pool);
+}
+
+static void test_future_done(void)
+{
+	struct tp_pool *pool = tp_create(1);
+	assert(pool != NULL);
+	struct tp_future *f = tp_submit(pool, square, (void *) 3);
+	tp_join_all(pool);
+	assert(tp_future_done(f));
+	assert((intptr_t) tp_future_wait(f) == 9);
+	tp_destroy(pool);
+}
+
+int main(void)
+{
+	unsigned sizes[] = { 1, 2, 4, 0 };
+	for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		test_futures(sizes[i]);
+		test_join_all(sizes[i]);
+		test_nested(sizes[i]);
+	}
+	test_future_done();
+	tp_destroy(tp_create(8)); // destroyed while every worker sleeps
+	printf("threadpool: all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,449 @@
+#include "threadpool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("threadpool: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("threadpool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define DEQUE_INITIAL 64 // slots of a new deque. Must be a power of 2
+
+// A task is its own future: tp_future_wait frees it, or the worker when nobody waits for it
+struct tp_future
+{
+	struct tp_pool *pool;
+	tp_fn fn;
+	void *arg;
+	void *result;
+	bool has_waiter; // submitted with tp_submit
+	_Atomic bool done;
+	struct tp_future *next; // link of the injection queue
+};
+
+// Circular array of a deque. Replaced by one twice as large when full; the old one is kept until the pool is
+// destroyed since a thief may still be reading it
+struct tp_array
+{
+	int64_t mask;
+	struct tp_array *prev;
+	_Atomic(struct tp_future *) slot[];
+};
+
+// Chase-Lev deque: the owner pushes and takes at the bottom, thieves steal at the top. Signed indices so that
+// bottom - 1 may go below top while the last task is being taken
+struct tp_deque
+{
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+	_Atomic(struct tp_array *) array;
+};
+
+struct tp_worker
+{
+	struct tp_pool *pool;
+	struct tp_deque deque;
+	pthread_t thread;
+	unsigned rand; // xorshift state picking the first victim
+} __attribute__((aligned(64))); // the deque indices of neighbours do not share a cache line
+
+struct tp_pool
+{
+	unsigned count;
+	struct tp_worker *workers;
+
+	pthread_mutex_t inject_m; // injection queue of the tasks submitted from outside the pool
+	struct tp_future *inject_head;
+	struct tp_future *inject_tail;
+
+	_Atomic int64_t queued; // tasks in a deque or the injection queue. Briefly negative when taken before counted
+	_Atomic unsigned sleepers; // idle workers waiting on idle_cv
+	pthread_mutex_t idle_m;
+	pthread_cond_t idle_cv;
+	_Atomic bool stopping;
+
+	_Atomic int64_t outstanding; // tasks submitted and not completed yet
+	_Atomic unsigned waiters; // threads waiting on done_cv
+	pthread_mutex_t done_m;
+	pthread_cond_t done_cv;
+};
+
+static __thread struct tp_worker *tp_self; // the worker running on this thread, if any
+
+static struct tp_array *array_new(int64_t size, struct tp_array *prev)
+{
+	struct tp_array *a = (struct tp_array *) malloc(sizeof(struct tp_array) + size * sizeof(a->slot[0]));
+	if (a == NULL)
+		return NULL;
+	a->mask = size - 1;
+	a->prev = prev;
+	return a;
+}
+
+static bool deque_init(struct tp_deque *d)
+{
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	struct tp_array *a = array_new(DEQUE_INITIAL, NULL);
+	atomic_init(&d->array, a);
+	return a != NULL;
+}
+
+static void deque_free(struct tp_deque *d)
+{
+	struct tp_array *a = atomic_load(&d->array);
+	while (a != NULL)
+	{
+		struct tp_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+// Owner only
+static bool deque_push(struct tp_deque *d, struct tp_future *t)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+	struct tp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	if (b - top > a->mask)
+	{
+		struct tp_array *grown = array_new((a->mask + 1) * 2, a);
+		if (grown == NULL)
+			return false;
+		for (int64_t i = top; i < b; i++)
+			atomic_store_explicit(&grown->slot[i & grown->mask],
+				atomic_load_explicit(&a->slot[i & a->mask], memory_order_relaxed), memory_order_relaxed);
+		atomic_store_explicit(&d->array, grown, memory_order_release);
+		a = grown;
+	}
+	atomic_store_explicit(&a->slot[b & a->mask], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+// Owner only. NULL when empty
+static struct tp_future *deque_take(struct tp_deque *d)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	struct tp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+	struct tp_future *t = NULL;
+	if (top <= b)
+	{
+		t = atomic_load_explicit(&a->slot[b & a->mask], memory_order_relaxed);
+		if (top == b)
+		{
+			// The last task: race the thieves for it
+			if (atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1, memory_order_seq_cst,
+				memory_order_relaxed) == false)
+				t = NULL;
+			atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		}
+	}
+	else
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return t;
+}
+
+// Any thread. NULL when empty, or when another thread won the race for the top task (*lost is set then)
+static struct tp_future *deque_steal(struct tp_deque *d, bool *lost)
+{
+	int64_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (top >= b)
+		return NULL;
+	struct tp_array *a = atomic_load_explicit(&d->array, memory_order_acquire);
+	struct tp_future *t = atomic_load_explicit(&a->slot[top & a->mask], memory_order_relaxed);
+	if (atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1, memory_order_seq_cst,
+		memory_order_relaxed) == false)
+	{
+		*lost = true;
+		return NULL;
+	}
+	return t;
+}
+
+static struct tp_future *inject_pop(struct tp_pool *pool)
+{
+	if (atomic_load_explicit(&pool->queued, memory_order_relaxed) <= 0)
+		return NULL; // nothing anywhere. Spares the lock to idle workers
+	pthread_mutex_lock(&pool->inject_m);
+	struct tp_future *t = pool->inject_head;
+	if (t != NULL)
+	{
+		pool->inject_head = t->next;
+		if (pool->inject_head == NULL)
+			pool->inject_tail = NULL;
+	}
+	pthread_mutex_unlock(&pool->inject_m);
+	return t;
+}
+
+// Find a task for worker `w`, or for a thread outside the pool when it is NULL. *retry is set when a task may have
+// been missed
+static struct tp_future *find_task(struct tp_pool *pool, struct tp_worker *w, bool *retry)
+{
+	struct tp_future *t = w != NULL ? deque_take(&w->deque) : NULL;
+	if (t == NULL)
+		t = inject_pop(pool);
+	if (t == NULL && pool->count > 1)
+	{
+		unsigned start = 0;
+		if (w != NULL)
+		{
+			w->rand ^= w->rand << 13;
+			w->rand ^= w->rand >> 17;
+			w->rand ^= w->rand << 5;
+			start = w->rand % pool->count;
+		}
+		for (unsigned i = 0; i < pool->count && t == NULL; i++)
+		{
+			struct tp_worker *victim = &pool->workers[(start + i) % pool->count];
+			if (victim != w)
+				t = deque_steal(&victim->deque, retry);
+		}
+	}
+	if (t != NULL)
+		atomic_fetch_sub(&pool->queued, 1);
+	return t;
+}
+
+static void wake_waiters(struct tp_pool *pool)
+{
+	if (atomic_load(&pool->waiters) > 0)
+	{
+		pthread_mutex_lock(&pool->done_m);
+		pthread_cond_broadcast(&pool->done_cv);
+		pthread_mutex_unlock(&pool->done_m);
+	}
+}
+
+static void run_task(struct tp_pool *pool, struct tp_future *t)
+{
+	void *result = t->fn(t->arg);
+	if (t->has_waiter)
+	{
+		t->result = result;
+		atomic_store(&t->done, true); // t belongs to the waiter from here on
+	}
+	else
+		free(t);
+	atomic_fetch_sub(&pool->outstanding, 1);
+	wake_waiters(pool);
+}
+
+static void* workerfunc(void* worker_param)
+{
+	struct tp_worker *w = (struct tp_worker *) worker_param;
+	struct tp_pool *pool = w->pool;
+	tp_self = w;
+	for (;;)
+	{
+		bool retry = false;
+		struct tp_future *t = find_task(pool, w, &retry);
+		if (t != NULL)
+		{
+			run_task(pool, t);
+			continue;
+		}
+		if (retry)
+			continue;
+		// Nothing to do. A submitter counts its task in `queued` before it looks at `sleepers`, and this worker
+		// counts itself in `sleepers` before it looks at `queued`, so one of them sees the other
+		pthread_mutex_lock(&pool->idle_m);
+		atomic_fetch_add(&pool->sleepers, 1);
+		while (atomic_load(&pool->queued) <= 0 && atomic_load(&pool->stopping) == false)
+			pthread_cond_wait(&pool->idle_cv, &pool->idle_m);
+		atomic_fetch_sub(&pool->sleepers, 1);
+		pthread_mutex_unlock(&pool->idle_m);
+		if (atomic_load(&pool->stopping) && atomic_load(&pool->queued) <= 0)
+			break;
+	}
+	return worker_param;
+}
+
+static struct tp_future *enqueue(struct tp_pool *pool, tp_fn fn, void *arg, bool has_waiter)
+{
+	struct tp_future *t = (struct tp_future *) malloc(sizeof(struct tp_future));
+	if (t == NULL)
+		return NULL;
+	t->pool = pool;
+	t->fn = fn;
+	t->arg = arg;
+	t->result = NULL;
+	t->has_waiter = has_waiter;
+	atomic_init(&t->done, false);
+	t->next = NULL;
+	atomic_fetch_add(&pool->outstanding, 1);
+	if (tp_self == NULL || tp_self->pool != pool || deque_push(&tp_self->deque, t) == false)
+	{
+		pthread_mutex_lock(&pool->inject_m);
+		if (pool->inject_tail != NULL)
+			pool->inject_tail->next = t;
+		else
+			pool->inject_head = t;
+		pool->inject_tail = t;
+		pthread_mutex_unlock(&pool->inject_m);
+	}
+	atomic_fetch_add(&pool->queued, 1);
+	if (atomic_load(&pool->sleepers) > 0)
+	{
+		pthread_mutex_lock(&pool->idle_m);
+		pthread_cond_signal(&pool->idle_cv);
+		pthread_mutex_unlock(&pool->idle_m);
+	}
+	wake_waiters(pool); // a worker blocked in tp_future_wait may run it
+	return t;
+}
+
+struct tp_future *tp_submit(struct tp_pool *pool, tp_fn fn, void *arg)
+{
+	return enqueue(pool, fn, arg, true);
+}
+
+bool tp_post(struct tp_pool *pool, tp_fn fn, void *arg)
+{
+	return enqueue(pool, fn, arg, false) != NULL;
+}
+
+bool tp_future_done(const struct tp_future *future)
+{
+	return atomic_load(&future->done);
+}
+
+// Block until `cond` holds. Completions broadcast done_cv whenever a thread is counted in `waiters`
+static void wait_done(struct tp_pool *pool, bool (*cond)(void *), void *arg)
+{
+	atomic_fetch_add(&pool->waiters, 1);
+	pthread_mutex_lock(&pool->done_m);
+	while (cond(arg) == false)
+		pthread_cond_wait(&pool->done_cv, &pool->done_m);
+	pthread_mutex_unlock(&pool->done_m);
+	atomic_fetch_sub(&pool->waiters, 1);
+}
+
+static bool future_done_cond(void *arg)
+{
+	return tp_future_done((struct tp_future *) arg);
+}
+
+// A worker waiting for a future also wakes up when there is work, since the future may depend on it
+static bool future_done_or_work_cond(void *arg)
+{
+	struct tp_future *future = (struct tp_future *) arg;
+	return tp_future_done(future) || atomic_load(&future->pool->queued) > 0;
+}
+
+void *tp_future_wait(struct tp_future *future)
+{
+	struct tp_pool *pool = future->pool;
+	struct tp_worker *w = (tp_self != NULL && tp_self->pool == pool) ? tp_self : NULL;
+	while (tp_future_done(future) == false)
+	{
+		if (w == NULL)
+		{
+			wait_done(pool, future_done_cond, future);
+			break;
+		}
+		bool retry = false;
+		struct tp_future *t = find_task(pool, w, &retry);
+		if (t != NULL)
+			run_task(pool, t); // help instead of blocking a worker
+		else if (retry == false)
+			wait_done(pool, future_done_or_work_cond, future); // the task runs on another worker
+	}
+	void *result = future->result;
+	free(future);
+	return result;
+}
+
+static bool all_done_cond(void *arg)
+{
+	return atomic_load(&((struct tp_pool *) arg)->outstanding) == 0;
+}
+
+void tp_join_all(struct tp_pool *pool)
+{
+	wait_done(pool, all_done_cond, pool);
+}
+
+// Stop the first `started` workers, then free the first `deques` deques and the pool
+static void free_pool(struct tp_pool *pool, unsigned started, unsigned deques)
+{
+	pthread_mutex_lock(&pool->idle_m);
+	atomic_store(&pool->stopping, true);
+	pthread_cond_broadcast(&pool->idle_cv);
+	pthread_mutex_unlock(&pool->idle_m);
+	for (unsigned i = 0; i < started; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (unsigned i = 0; i < deques; i++)
+		deque_free(&pool->workers[i].deque);
+	pthread_mutex_destroy(&pool->inject_m);
+	pthread_mutex_destroy(&pool->idle_m);
+	pthread_cond_destroy(&pool->idle_cv);
+	pthread_mutex_destroy(&pool->done_m);
+	pthread_cond_destroy(&pool->done_cv);
+	free(pool->workers);
+	free(pool);
+}
+
+struct tp_pool *tp_create(unsigned workers)
+{
+	if (workers == 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = n > 0 ? (unsigned) n : 1;
+	}
+	struct tp_pool *pool = (struct tp_pool *) calloc(1, sizeof(struct tp_pool));
+	if (pool == NULL)
+		return NULL;
+	if (posix_memalign((void **) &pool->workers, 64, workers * sizeof(struct tp_worker)) != 0)
+	{
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->inject_m, NULL);
+	pthread_mutex_init(&pool->idle_m, NULL);
+	pthread_cond_init(&pool->idle_cv, NULL);
+	pthread_mutex_init(&pool->done_m, NULL);
+	pthread_cond_init(&pool->done_cv, NULL);
+	for (unsigned i = 0; i < workers; i++)
+	{
+		struct tp_worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->rand = 2463534242u + i * 2654435761u;
+		if (deque_init(&w->deque) == false)
+		{
+			ERROR_LOG("Failed to allocate a deque!");
+			free_pool(pool, 0, i + 1);
+			return NULL;
+		}
+	}
+	pool->count = workers;
+	for (unsigned i = 0; i < workers; i++)
+	{
+		if (pthread_create(&pool->workers[i].thread, NULL, workerfunc, &pool->workers[i]) != 0)
+		{
+			ERROR_LOG("Failed to create worker %u!", i);
+			free_pool(pool, i, workers);
+			return NULL;
+		}
+	}
+	DEBUG_LOG("started %u workers", workers);
+	return pool;
+}
+
+void tp_destroy(struct tp_pool *pool)
+{
+	tp_join_all(pool);
+	free_pool(pool, pool->count, pool->count);
+}
@@ -0,0 +1,62 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+
+/**
+ * A work-stealing thread pool.
+ *
+ * Every worker owns a deque: tasks submitted from a worker are pushed on its own deque and popped from the same end
+ * (LIFO, the data is still hot in its cache), while idle workers steal from the other end of the deques of others.
+ * Tasks submitted from outside the pool go through a shared injection queue. Idle workers sleep until there is work.
+ */
+struct tp_pool;
+
+/**
+ * A task whose result is waited for. Returned by tp_submit and released by tp_future_wait
+ */
+struct tp_future;
+
+typedef void *(*tp_fn)(void *arg);
+
+/**
+ * Start a pool of @param workers threads, one per online CPU when 0.
+ * @return the pool, or NULL if it could not be created.
+ */
+struct tp_pool *tp_create(unsigned workers);
+
+/**
+ * Run @param fn with @param arg on the pool.
+ * @return a future to wait on for the result, or NULL if the task could not be allocated.
+ */
+struct tp_future *tp_submit(struct tp_pool *pool, tp_fn fn, void *arg);
+
+/**
+ * Run @param fn with @param arg on the pool without waiting for it individually; see tp_join_all.
+ * @return false if the task could not be allocated.
+ */
+bool tp_post(struct tp_pool *pool, tp_fn fn, void *arg);
+
+/**
+ * Wait for the task of @param future to complete, release the future and return the value returned by the task.
+ * Called from a worker, the worker runs other tasks meanwhile, so that tasks may wait on tasks they submitted.
+ */
+void *tp_future_wait(struct tp_future *future);
+
+/**
+ * @return true if the task of @param future completed, so that tp_future_wait would not block.
+ */
+bool tp_future_done(const struct tp_future *future);
+
+/**
+ * Wait until every task submitted or posted so far, and the tasks they submitted, completed.
+ * Must not be called from a worker of @param pool.
+ */
+void tp_join_all(struct tp_pool *pool);
+
+/**
+ * Join all tasks, stop the workers and free @param pool.
+ */
+void tp_destroy(struct tp_pool *pool);
+
+#endif /* THREADPOOL_H */
@@ -54,10 +54,11 @@ fi
 # make clean
 # make
 
+# One writer for all the files, fed a manifest of "path<TAB>content" lines
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "${username}$i.txt" "$WRITESTR"
+done | writer -C "$WRITEDIR" > /dev/null
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
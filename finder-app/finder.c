@@ -0,0 +1,197 @@
+/*
+ * finder: count the files of a directory and the lines of those files that contain a string
+ *
+ * Same arguments and output as finder.sh, without a grep per file: the directory is read with getdents64, batches of
+ * files go to the threads of a work-stealing pool, each file is mmapped and searched with SSE2 or NEON when available.
+ * Like the script, only the regular files directly in the directory count (symlinks followed, hidden files skipped),
+ * and the string is matched literally.
+ */
+
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h> // DT_REG, DT_LNK, DT_UNKNOWN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "threadpool.h"
+#include "aesd-memmem.h" // shared with the queries of aesdsocket
+
+#define BATCH_FILES 64 // files per task, so that tiny files do not cost a task each
+#define DENTS_BUF (64 * 1024)
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct batch
+{
+	int count;
+	unsigned char type[BATCH_FILES];
+	char name[BATCH_FILES][256];
+};
+
+static int dir_fd;
+static const char *needle;
+static size_t needle_len;
+static _Atomic unsigned long num_files;
+static _Atomic unsigned long num_lines;
+
+// First occurrence of needle in [p, end), or NULL
+static const char *find(const char *p, const char *end)
+{
+	return aesd_memmem(p, end - p, needle, needle_len);
+}
+
+// Number of lines of [p, end) that contain the needle. A last line without a newline counts, like for grep
+static unsigned long count_lines(const char *p, const char *end)
+{
+	unsigned long lines = 0;
+	if (needle_len == 0)
+	{
+		// grep matches every line with an empty pattern
+		for (const char *nl; p < end && (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+			lines++;
+		return lines + (p < end);
+	}
+	const char *hit;
+	while (p < end && (hit = find(p, end)) != NULL)
+	{
+		lines++;
+		const char *nl = memchr(hit, '\n', end - hit); // the rest of this line is not searched
+		if (nl == NULL)
+			break;
+		p = nl + 1;
+	}
+	return lines;
+}
+
+// Search one file of the directory. Returns false when it is not a regular file
+static bool search_file(const char *name, unsigned char type)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK); // O_NONBLOCK: never hang on a FIFO
+	struct stat st;
+	if (fd == -1)
+	{
+		// Cannot be read: like for grep, it counts as a file with no match if it is one
+		if (type == DT_REG || (fstatat(dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode)))
+		{
+			fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+			return true;
+		}
+		return false;
+	}
+	if (fstat(fd, &st) != 0 || S_ISREG(st.st_mode) == false)
+	{
+		close(fd);
+		return false;
+	}
+	unsigned long lines = 0;
+	if (st.st_size > 0)
+	{
+		char *map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			lines = count_lines(map, map + st.st_size);
+			munmap(map, st.st_size);
+		}
+		else
+		{
+			// Not mmappable: read it whole
+			char *buf = (char *) malloc(st.st_size);
+			ssize_t len = 0, r;
+			while (buf != NULL && len < st.st_size && (r = read(fd, buf + len, st.st_size - len)) > 0)
+				len += r;
+			if (buf != NULL)
+				lines = count_lines(buf, buf + len);
+			free(buf);
+		}
+	}
+	close(fd);
+	atomic_fetch_add(&num_lines, lines);
+	return true;
+}
+
+static void *search_batch(void *arg)
+{
+	struct batch *b = (struct batch *) arg;
+	unsigned long files = 0;
+	for (int i = 0; i < b->count; i++)
+		files += search_file(b->name[i], b->type[i]);
+	atomic_fetch_add(&num_files, files);
+	free(b);
+	return NULL;
+}
+
+int main (int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		printf("Incorrect number of arguments!\n");
+		exit(1);
+	}
+	dir_fd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1)
+	{
+		printf("%s is NOT a directory!\n", argv[1]);
+		exit(1);
+	}
+	needle = argv[2];
+	needle_len = strlen(needle);
+
+	struct tp_pool *pool = tp_create(0);
+	if (pool == NULL)
+	{
+		fprintf(stderr, "finder: Failure to start the thread pool\n");
+		exit(1);
+	}
+	char *dents = (char *) malloc(DENTS_BUF);
+	struct batch *b = NULL;
+	long n;
+	while (dents != NULL && (n = syscall(SYS_getdents64, dir_fd, dents, DENTS_BUF)) > 0)
+	{
+		for (long off = 0; off < n; )
+		{
+			struct linux_dirent64 *d = (struct linux_dirent64 *) (dents + off);
+			off += d->d_reclen;
+			if (d->d_name[0] == '.')
+				continue; // hidden, like for the * of the script. Also . and ..
+			if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+				continue; // a directory, device, ... Symlinks and unknown types are looked at by the task
+			if (b == NULL && (b = (struct batch *) malloc(sizeof(struct batch))) != NULL)
+				b->count = 0;
+			if (b == NULL)
+				break;
+			b->type[b->count] = d->d_type;
+			strcpy(b->name[b->count], d->d_name);
+			if (++b->count == BATCH_FILES)
+			{
+				if (tp_post(pool, search_batch, b) == false)
+					search_batch(b);
+				b = NULL;
+			}
+		}
+	}
+	if (b != NULL)
+		search_batch(b); // the last, partial batch runs here while the pool finishes
+	tp_destroy(pool);
+	free(dents);
+	close(dir_fd);
+
+	printf("The number of files are %lu and the number of matching lines are %lu\n", atomic_load(&num_files),
+		atomic_load(&num_lines));
+	exit(0);
+}
@@ -1,5 +1,11 @@
 #!/bin/sh
 
+# The compiled finder, when installed, does the same much faster
+if command -v finder > /dev/null 2>&1;
+then
+	exec finder "$@"
+fi
+
 if [[ $# != 2 ]];
 then
 	echo "Incorrect number of arguments!"
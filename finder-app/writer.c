@@ -1,13 +1,575 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define BATCH_DEFAULT 64
+#define BATCH_MAX 1024
+
+/*
+ * Bulk mode: many files from one manifest, in batches.
+ * Each file is created with openat relative to the directory of -C and filled with pwrite, or, with --uring, a batch
+ * takes one io_uring_enter for its opens and one for its writes and closes. With --sync the data of every file is
+ * flushed with fdatasync before it is closed, all the files of a batch at once: writeback of the whole batch is started
+ * before the first wait, or the fsyncs are linked in the same submit. A single fsync of the directory then makes the
+ * names of the batch durable.
+ */
+struct entry
+{
+	const char *path;
+	const char *data;
+	size_t len;
+	int fd;
+	bool failed;
+};
+
+static int dir_fd = -1;
+static bool do_sync = false;
+static int failures = 0;
+
+static void entry_fail (struct entry *e, const char *what, int err)
+{
+	syslog(LOG_USER | LOG_ERR, "Can't %s %s because: %s", what, e->path, strerror(err));
+	e->failed = true;
+	failures++;
+}
+
+// pwrite what is left of @param e from @param off
+static bool write_rest (struct entry *e, size_t off)
+{
+	while (off < e->len)
+	{
+		ssize_t n = pwrite(e->fd, e->data + off, e->len - off, off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			entry_fail(e, "write", n == 0 ? EIO : errno);
+			return false;
+		}
+		off += n;
+	}
+	return true;
+}
+
+// Close @param e, after flushing its data with --sync
+static void close_entry (struct entry *e)
+{
+	if (do_sync && e->failed == false && fdatasync(e->fd) != 0)
+		entry_fail(e, "sync", errno);
+	if (close(e->fd) != 0 && e->failed == false)
+		entry_fail(e, "close", errno);
+	e->fd = -1;
+}
+
+static void write_batch_plain (struct entry *batch, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		struct entry *e = &batch[i];
+		e->fd = openat(dir_fd, e->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (e->fd == -1)
+		{
+			entry_fail(e, "open", errno);
+			continue;
+		}
+		if (write_rest(e, 0) && do_sync)
+			sync_file_range(e->fd, 0, 0, SYNC_FILE_RANGE_WRITE); // start writeback; sync_batch waits for it
+		else
+			close_entry(e);
+	}
+}
+
+// --sync: flush the files of a batch still open, then their names with one fsync of the directory
+static void sync_batch (struct entry *batch, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (batch[i].fd != -1)
+			close_entry(&batch[i]);
+	}
+	if (fsync(dir_fd) == 0)
+		return;
+	int err = errno;
+	for (int i = 0; i < n; i++)
+	{
+		if (batch[i].failed == false)
+			entry_fail(&batch[i], "sync", err);
+	}
+}
+
+/*
+ * io_uring, through raw syscalls like the aesdsocket engine so that there is no liburing dependency
+ */
+static struct
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring_ptr;
+	size_t ring_sz, sqes_sz;
+} ring = { .fd = -1 };
+
+enum { OP_OPEN, OP_WRITE, OP_SYNC, OP_CLOSE };
+
+static bool ring_setup (unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if (ring.fd < 0)
+		return false;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+	{
+		close(ring.fd);
+		ring.fd = -1;
+		errno = ENOSYS;
+		return false;
+	}
+	size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	ring.ring_ptr = mmap(NULL, ring.ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+		IORING_OFF_SQ_RING);
+	ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQES);
+	if (ring.ring_ptr == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		int err = errno;
+		if (ring.ring_ptr != MAP_FAILED)
+			munmap(ring.ring_ptr, ring.ring_sz);
+		if (ring.sqes != MAP_FAILED)
+			munmap(ring.sqes, ring.sqes_sz);
+		close(ring.fd);
+		ring.fd = -1;
+		errno = err;
+		return false;
+	}
+	char *r = (char *) ring.ring_ptr;
+	ring.sq_head = (unsigned *) (r + p.sq_off.head);
+	ring.sq_tail = (unsigned *) (r + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (r + p.sq_off.ring_mask);
+	unsigned *sq_array = (unsigned *) (r + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i; // sqes are used in ring order
+	ring.cq_head = (unsigned *) (r + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (r + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (r + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (r + p.cq_off.cqes);
+	ring.sq_entries = p.sq_entries;
+	ring.sq_local_tail = *ring.sq_tail;
+	return true;
+}
+
+static void ring_cleanup (void)
+{
+	if (ring.fd == -1)
+		return;
+	munmap(ring.sqes, ring.sqes_sz);
+	munmap(ring.ring_ptr, ring.ring_sz);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+// The ring is sized for a whole phase of a batch, so a sqe is always free here
+static struct io_uring_sqe *ring_sqe (int op, int index, uint8_t flags)
+{
+	struct io_uring_sqe *sqe = &ring.sqes[ring.sq_local_tail++ & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->flags = flags;
+	sqe->user_data = (uint64_t) index << 2 | op;
+	return sqe;
+}
+
+static void on_cqe (int op, int index, int res, struct entry *batch);
+
+// Submit what was prepared and reap @param expected completions of the files of @param batch
+static bool ring_run (unsigned expected, struct entry *batch)
+{
+	unsigned to_submit = ring.sq_local_tail - *ring.sq_tail;
+	__atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+	while (expected > 0)
+	{
+		int ret = (int) syscall(__NR_io_uring_enter, ring.fd, to_submit, expected, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		to_submit -= ret;
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			on_cqe(cqe->user_data & 3, (int) (cqe->user_data >> 2), cqe->res, batch);
+			head++;
+			expected--;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+static void on_cqe (int op, int index, int res, struct entry *batch)
+{
+	struct entry *e = &batch[index];
+	switch (op)
+	{
+	case OP_OPEN:
+		if (res < 0)
+			entry_fail(e, "open", -res);
+		else
+			e->fd = res;
+		break;
+	case OP_WRITE:
+		if (res >= 0 && (size_t) res < e->len)
+		{
+			// A short write cancels the rest of the chain; do the rest here
+			if (write_rest(e, res))
+				close_entry(e);
+		}
+		else if (res < 0)
+			entry_fail(e, "write", -res);
+		break;
+	case OP_SYNC:
+		if (res < 0 && res != -ECANCELED)
+			entry_fail(e, "sync", -res);
+		break;
+	case OP_CLOSE:
+		if (res == 0)
+			e->fd = -1;
+		else if (res != -ECANCELED)
+		{
+			entry_fail(e, "close", -res);
+			e->fd = -1;
+		}
+		break;
+	}
+}
+
+static bool write_batch_uring (struct entry *batch, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		struct io_uring_sqe *sqe = ring_sqe(OP_OPEN, i, 0);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = dir_fd;
+		sqe->addr = (uint64_t) (uintptr_t) batch[i].path;
+		sqe->len = 0644;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	}
+	bool ok = ring_run(n, batch);
+
+	// write -> fdatasync with --sync -> close, linked per file, the chains of all the files in one submit
+	unsigned expected = 0;
+	for (int i = 0; ok && i < n; i++)
+	{
+		if (batch[i].failed)
+			continue;
+		struct io_uring_sqe *sqe = ring_sqe(OP_WRITE, i, IOSQE_IO_LINK);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = batch[i].fd;
+		sqe->addr = (uint64_t) (uintptr_t) batch[i].data;
+		sqe->len = batch[i].len;
+		sqe->off = 0;
+		if (do_sync)
+		{
+			sqe = ring_sqe(OP_SYNC, i, IOSQE_IO_LINK);
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = batch[i].fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			expected++;
+		}
+		sqe = ring_sqe(OP_CLOSE, i, 0);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = batch[i].fd;
+		expected += 2;
+	}
+	if (ok)
+		ok = ring_run(expected, batch);
+	for (int i = 0; i < n; i++)
+	{
+		if (batch[i].fd != -1)
+		{
+			close(batch[i].fd); // the chain was cut short, or the ring failed
+			batch[i].fd = -1;
+		}
+	}
+	return ok;
+}
+
+// Read all of @param fd into a NUL terminated malloc'd buffer
+static char *read_all (int fd, size_t *len)
+{
+	size_t cap = 65536;
+	size_t n = 0;
+	char *buf = (char *) malloc(cap + 1);
+	while (buf != NULL)
+	{
+		if (n == cap)
+		{
+			char *bigger = (char *) realloc(buf, cap * 2 + 1);
+			if (bigger == NULL)
+				break;
+			buf = bigger;
+			cap *= 2;
+		}
+		ssize_t r = read(fd, buf + n, cap - n);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		if (r == 0)
+		{
+			buf[n] = '\0';
+			*len = n;
+			return buf;
+		}
+		n += r;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Split the manifest in place. One file per line, "path<TAB>content", or with -0 "path\0content\0" pairs so that the
+ * content can hold anything
+ */
+static struct entry *parse_manifest (char *buf, size_t len, bool nul, int *count)
+{
+	size_t cap = 1024;
+	int n = 0;
+	struct entry *entries = (struct entry *) malloc(cap * sizeof(struct entry));
+	char *p = buf;
+	char *end = buf + len;
+	int line = 0;
+	while (entries != NULL && p < end)
+	{
+		struct entry e = { .fd = -1, .failed = false };
+		line++;
+		if (nul)
+		{
+			e.path = p;
+			p += strlen(p) + 1;
+			if (p >= end)
+			{
+				syslog(LOG_USER | LOG_ERR, "No content for %s in the manifest", e.path);
+				failures++;
+				break;
+			}
+			e.data = p;
+			e.len = strlen(p);
+			p += e.len + 1;
+		}
+		else
+		{
+			char *nl = (char *) memchr(p, '\n', end - p);
+			if (nl == NULL)
+				nl = end;
+			*nl = '\0';
+			char *tab = strchr(p, '\t');
+			if (tab == NULL)
+			{
+				if (nl > p)
+				{
+					syslog(LOG_USER | LOG_ERR, "Malformed manifest line %d", line);
+					failures++;
+				}
+				p = nl + 1;
+				continue;
+			}
+			*tab = '\0';
+			e.path = p;
+			e.data = tab + 1;
+			e.len = nl - (tab + 1);
+			p = nl + 1;
+		}
+		if ((size_t) n == cap)
+		{
+			struct entry *bigger = (struct entry *) realloc(entries, cap * 2 * sizeof(struct entry));
+			if (bigger == NULL)
+			{
+				free(entries);
+				return NULL;
+			}
+			entries = bigger;
+			cap *= 2;
+		}
+		entries[n++] = e;
+	}
+	*count = n;
+	return entries;
+}
+
+static void usage (void)
+{
+	fprintf(stderr, "Usage: writer <file> <string>\n"
+		"       writer [-m <manifest>|-] [-C <dir>] [-0] [-b <files per batch>] [--uring] [--sync]\n");
+}
+
+static int bulk_main (int argc, char **argv)
+{
+	static const struct option long_options[] =
+	{
+		{ "manifest", required_argument, NULL, 'm' },
+		{ "directory", required_argument, NULL, 'C' },
+		{ "null", no_argument, NULL, '0' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "uring", no_argument, NULL, 'u' },
+		{ "sync", no_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *manifest = "-";
+	const char *dir = ".";
+	bool nul = false;
+	bool use_uring = false;
+	int batch_size = BATCH_DEFAULT;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "m:C:0b:us", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'C':
+			dir = optarg;
+			break;
+		case '0':
+			nul = true;
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			if (batch_size < 1 || batch_size > BATCH_MAX)
+			{
+				fprintf(stderr, "The batch size is 1 to %d files\n", BATCH_MAX);
+				return 1;
+			}
+			break;
+		case 'u':
+			use_uring = true;
+			break;
+		case 's':
+			do_sync = true;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind == argc - 1 && strcmp(argv[optind], "-") == 0)
+	{
+		manifest = "-"; // the manifest on stdin, the default
+		optind++;
+	}
+	if (optind != argc)
+	{
+		usage();
+		return 1;
+	}
+
+	if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+	{
+		syslog(LOG_USER | LOG_ERR, "Can't open directory %s because: %s", dir, strerror(errno));
+		return 1;
+	}
+	int in = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY | O_CLOEXEC);
+	size_t len = 0;
+	char *buf = in == -1 ? NULL : read_all(in, &len);
+	if (buf == NULL)
+	{
+		syslog(LOG_USER | LOG_ERR, "Can't read manifest %s because: %s", manifest, strerror(errno));
+		return 1;
+	}
+	if (in != STDIN_FILENO)
+		close(in);
+	int count = 0;
+	struct entry *entries = parse_manifest(buf, len, nul, &count);
+	if (entries == NULL)
+	{
+		syslog(LOG_USER | LOG_ERR, "Out of memory for the manifest");
+		return 1;
+	}
+	if (use_uring && ring_setup(batch_size * 3) == false)
+	{
+		syslog(LOG_USER | LOG_WARNING, "No io_uring (%s), writing with pwrite", strerror(errno));
+		use_uring = false;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	size_t bytes = 0;
+	for (int i = 0; i < count; i += batch_size)
+	{
+		int n = count - i < batch_size ? count - i : batch_size;
+		if (use_uring == false || write_batch_uring(&entries[i], n) == false)
+		{
+			if (use_uring)
+			{
+				syslog(LOG_USER | LOG_ERR, "io_uring failed (%s), writing with pwrite", strerror(errno));
+				ring_cleanup();
+				use_uring = false;
+				// The files of this batch may be partly written: write them all again
+				for (int j = i; j < i + n; j++)
+				{
+					if (entries[j].failed)
+						failures--;
+					entries[j].failed = false;
+					entries[j].fd = -1;
+				}
+			}
+			write_batch_plain(&entries[i], n);
+		}
+		if (do_sync)
+			sync_batch(&entries[i], n);
+		for (int j = i; j < i + n; j++)
+			if (entries[j].failed == false)
+				bytes += entries[j].len;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ring_cleanup();
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	int written = count;
+	for (int i = 0; i < count; i++)
+		written -= entries[i].failed;
+	printf("Wrote %d files, %zu bytes in %.3f s: %.0f files/sec\n", written, bytes, secs,
+		secs > 0 ? written / secs : 0.0);
+	syslog(LOG_USER | LOG_INFO, "Wrote %d files, %zu bytes in %.3f s", written, bytes, secs);
+	free(entries);
+	free(buf);
+	close(dir_fd);
+	return failures == 0 ? 0 : 1;
+}
 
 int main (int argc, char **argv)
 {
 	openlog("WRITER ", LOG_PID, LOG_USER);
 
+	// An option, or "-" for the manifest on stdin, selects bulk mode
+	if (argc > 1 && argv[1][0] == '-')
+	{
+		int ret = bulk_main(argc, argv);
+		closelog();
+		exit(ret);
+	}
 	if (argc != 3)
 	{
 		syslog(LOG_USER | LOG_ERR, "Insufficient arguments!");
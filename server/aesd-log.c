@@ -0,0 +1,251 @@
+/**
+ * @file aesd-log.c
+ * @brief Asynchronous logging to syslog
+ *
+ * The ring is a bounded multi-producer queue: a producer claims a slot by advancing tail with a compare-and-swap,
+ * fills it, then publishes it through the sequence number of the slot. The background thread is the only consumer.
+ * It sleeps on an eventfd, which producers only write to when the thread announced it is going to sleep, so a busy
+ * producer makes no syscall at all.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "aesd-log.h"
+
+#define RING_MASK (AESD_LOG_RING_SIZE - 1)
+
+struct log_rec
+{
+	_Atomic size_t seq; // pos when free for the producer of pos, pos + 1 once published for the consumer
+	int level;
+	enum aesd_log_event event;
+	int sock;
+	char text[AESD_LOG_TEXT_MAX]; // the message, or the peer of a connection event
+};
+
+static struct log_rec ring[AESD_LOG_RING_SIZE];
+static _Atomic size_t tail; // next slot to claim
+static size_t head; // next slot to drain. Background thread only
+
+static int max_level = LOG_DEBUG;
+static unsigned rate_limit = 0;
+static _Atomic long rate_window = -1; // second the rate is counted for
+static _Atomic unsigned rate_count;
+static _Atomic unsigned long dropped; // records lost to the rate limit or to a full ring
+
+static _Atomic bool running = false;
+static _Atomic bool sleeping = false;
+static int efd = -1;
+static pthread_t drain_thread;
+
+void aesd_log_set (int level, unsigned rate)
+{
+	max_level = level;
+	rate_limit = rate;
+}
+
+static bool rate_ok (int level)
+{
+	if (rate_limit == 0 || level <= LOG_ERR)
+		return true;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	long w = atomic_load(&rate_window);
+	if (w != ts.tv_sec && atomic_compare_exchange_strong(&rate_window, &w, ts.tv_sec))
+		atomic_store(&rate_count, 0); // a new second. Another producer may have counted one record early. Harmless
+	return atomic_fetch_add(&rate_count, 1) < rate_limit;
+}
+
+static void format_rec (const struct log_rec *r)
+{
+	switch (r->event)
+	{
+	case AESD_LOG_ACCEPT:
+		syslog(LOG_USER | r->level, "Accepted connection from %s fd=%d", r->text, r->sock);
+		break;
+	case AESD_LOG_CLOSE:
+		syslog(LOG_USER | r->level, "Closed connection from %s fd=%d", r->text, r->sock);
+		break;
+	default:
+		syslog(LOG_USER | r->level, "%s", r->text);
+		break;
+	}
+}
+
+// Claim a slot of the ring. NULL when it is full
+static struct log_rec *claim (size_t *pos_rtn)
+{
+	size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	for (;;)
+	{
+		struct log_rec *r = &ring[pos & RING_MASK];
+		intptr_t dif = (intptr_t) atomic_load_explicit(&r->seq, memory_order_acquire) - (intptr_t) pos;
+		if (dif == 0 && atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed,
+			memory_order_relaxed))
+		{
+			*pos_rtn = pos;
+			return r;
+		}
+		if (dif < 0)
+			return NULL; // the slot still holds the record of the previous lap
+		if (dif > 0)
+			pos = atomic_load_explicit(&tail, memory_order_relaxed); // another producer took it
+	}
+}
+
+static void publish (struct log_rec *r, size_t pos)
+{
+	atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+	// Store seq, then load sleeping, while drain_func stores sleeping, then loads seq. Without a full fence on both
+	// sides each could load the old value of the other and the wakeup would be lost
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&sleeping) && atomic_exchange(&sleeping, false))
+	{
+		uint64_t one = 1;
+		ssize_t ret = write(efd, &one, sizeof(one)); // wake the background thread up
+		(void) ret;
+	}
+}
+
+// Write out the oldest published record. Returns false when there is none
+static bool drain_one (void)
+{
+	struct log_rec *r = &ring[head & RING_MASK];
+	if (atomic_load_explicit(&r->seq, memory_order_acquire) != head + 1)
+		return false;
+	format_rec(r);
+	atomic_store_explicit(&r->seq, head + AESD_LOG_RING_SIZE, memory_order_release); // free for the next lap
+	head++;
+	return true;
+}
+
+static void *drain_func (void *arg)
+{
+	for (;;)
+	{
+		while (drain_one())
+			;
+		unsigned long lost = atomic_exchange(&dropped, 0);
+		if (lost > 0)
+			syslog(LOG_USER | LOG_WARNING, "%lu log records dropped", lost);
+		if (atomic_load(&running) == false)
+			break; // stopped, and everything is written out
+		atomic_store(&sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst); // pairs with the one in publish
+		if (atomic_load_explicit(&ring[head & RING_MASK].seq, memory_order_acquire) == head + 1)
+		{
+			atomic_store(&sleeping, false); // published before the producer could see `sleeping`
+			continue;
+		}
+		uint64_t v;
+		ssize_t ret = read(efd, &v, sizeof(v));
+		(void) ret;
+	}
+	return NULL;
+}
+
+int aesd_log_start (void)
+{
+	for (size_t i = 0; i < AESD_LOG_RING_SIZE; i++)
+		atomic_store(&ring[i].seq, i);
+	atomic_store(&tail, 0);
+	head = 0;
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd == -1)
+		return -1;
+	// The thread never handles the termination signals
+	sigset_t term, old;
+	sigemptyset(&term);
+	sigaddset(&term, SIGINT);
+	sigaddset(&term, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &term, &old);
+	atomic_store(&running, true);
+	int ret = pthread_create(&drain_thread, NULL, drain_func, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		atomic_store(&running, false);
+		close(efd);
+		efd = -1;
+		return -1;
+	}
+	atexit(aesd_log_stop); // so that an exit() does not lose what is still in the ring
+	return 0;
+}
+
+void aesd_log_stop (void)
+{
+	if (atomic_exchange(&running, false) == false)
+		return;
+	uint64_t one = 1;
+	ssize_t ret = write(efd, &one, sizeof(one));
+	(void) ret;
+	pthread_join(drain_thread, NULL);
+	close(efd);
+	efd = -1;
+}
+
+void aesd_log (int level, const char *fmt, ...)
+{
+	if (level > max_level)
+		return;
+	if (rate_ok(level) == false)
+	{
+		atomic_fetch_add(&dropped, 1);
+		return;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	size_t pos;
+	struct log_rec *r = atomic_load(&running) ? claim(&pos) : NULL;
+	if (r != NULL)
+	{
+		r->level = level;
+		r->event = AESD_LOG_TEXT;
+		vsnprintf(r->text, sizeof(r->text), fmt, ap);
+		publish(r, pos);
+	}
+	else if (atomic_load(&running) == false)
+		vsyslog(LOG_USER | level, fmt, ap); // no background thread
+	else
+		atomic_fetch_add(&dropped, 1);
+	va_end(ap);
+}
+
+void aesd_log_conn (enum aesd_log_event event, int sock, const char *peer)
+{
+	if (LOG_INFO > max_level)
+		return;
+	if (rate_ok(LOG_INFO) == false)
+	{
+		atomic_fetch_add(&dropped, 1);
+		return;
+	}
+	size_t pos;
+	struct log_rec local;
+	struct log_rec *r = atomic_load(&running) ? claim(&pos) : &local;
+	if (r == NULL)
+	{
+		atomic_fetch_add(&dropped, 1);
+		return;
+	}
+	r->level = LOG_INFO;
+	r->event = event;
+	r->sock = sock;
+	strncpy(r->text, peer, sizeof(r->text) - 1);
+	r->text[sizeof(r->text) - 1] = '\0';
+	if (r == &local)
+		format_rec(r); // no background thread
+	else
+		publish(r, pos);
+}
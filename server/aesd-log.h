@@ -0,0 +1,51 @@
+/*
+ * aesd-log.h
+ *
+ * Asynchronous logging to syslog: callers fill records of a lock-free ring, a background thread formats them and
+ * talks to syslog
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdbool.h>
+#include <syslog.h> // LOG_ERR, LOG_INFO, ...
+
+#define AESD_LOG_RING_SIZE 1024 // records waiting for the background thread. Must be a power of 2
+#define AESD_LOG_TEXT_MAX 160 // a message longer than this is cut
+
+enum aesd_log_event
+{
+	AESD_LOG_TEXT, // free form message
+	AESD_LOG_ACCEPT, // a connection was accepted
+	AESD_LOG_CLOSE, // a connection was closed
+};
+
+/**
+ * Drop the records less severe than @param max_level (a syslog level), and beyond @param rate records per second
+ * (0: no limit). Errors and worse are never rate limited
+ */
+extern void aesd_log_set (int max_level, unsigned rate);
+
+/**
+ * Start the background thread. Until then, and after aesd_log_stop, records are written synchronously. Call it after
+ * any fork: the thread does not survive one
+ */
+extern int aesd_log_start (void);
+
+/**
+ * Write out every record left and stop the background thread
+ */
+extern void aesd_log_stop (void);
+
+/**
+ * Log a message. Never blocks: the record is dropped, and counted, when the ring is full
+ */
+extern void aesd_log (int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Log a connection event as a compact record, formatted by the background thread
+ */
+extern void aesd_log_conn (enum aesd_log_event event, int sock, const char *peer);
+
+#endif /* AESD_LOG_H */
@@ -0,0 +1,65 @@
+/*
+ * aesd-memmem.h
+ *
+ * Substring search shared by the queries of aesdsocket and finder-app/finder. Candidates are the positions where both
+ * the first and the last byte of the needle match, 16 positions at a time with SSE2 or NEON; only those are compared
+ * in full. The includer defines _GNU_SOURCE, for memmem
+ */
+
+#ifndef AESD_MEMMEM_H
+#define AESD_MEMMEM_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// First occurrence of the `m` bytes of needle (m > 0) in the `n` bytes at p, or NULL
+static inline const char *aesd_memmem (const char *p, size_t n, const char *needle, size_t m)
+{
+	if (m == 1)
+		return (const char *) memchr(p, needle[0], n);
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[m - 1]);
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		__m128i f = _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *) (p + i)));
+		__m128i l = _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *) (p + i + m - 1)));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(f, l));
+		while (mask != 0)
+		{
+			unsigned bit = __builtin_ctz(mask);
+			if (memcmp(p + i + bit + 1, needle + 1, m - 2) == 0)
+				return p + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t first = vdupq_n_u8(needle[0]);
+	const uint8x16_t last = vdupq_n_u8(needle[m - 1]);
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		uint8x16_t f = vceqq_u8(first, vld1q_u8((const uint8_t *) (p + i)));
+		uint8x16_t l = vceqq_u8(last, vld1q_u8((const uint8_t *) (p + i + m - 1)));
+		// Narrow the 16 byte mask to 4 bits per byte
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(f, l)), 4)), 0);
+		while (mask != 0)
+		{
+			unsigned bit = __builtin_ctzll(mask) / 4;
+			if (memcmp(p + i + bit + 1, needle + 1, m - 2) == 0)
+				return p + i + bit;
+			mask &= ~(0xfULL << (bit * 4));
+		}
+	}
+#endif
+	return i < n ? (const char *) memmem(p + i, n - i, needle, m) : NULL; // the tail
+}
+
+#endif /* AESD_MEMMEM_H */
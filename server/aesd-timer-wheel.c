@@ -0,0 +1,104 @@
+/**
+ * @file aesd-timer-wheel.c
+ * @brief Hierarchical timer wheel
+ *
+ * Level 0 holds the timers expiring within the next 64 ticks, one slot per tick. Level n holds the timers expiring
+ * within the next 64^(n+1) ticks, one slot per 64^n ticks, and is cascaded down a level every time the level below
+ * wraps around. Adding and deleting a timer are O(1), and a tick only touches the timers that expire on it or that
+ * are cascaded. Any necessary locking must be performed by the caller.
+ */
+
+#include <string.h>
+
+#include "aesd-timer-wheel.h"
+
+#define WHEEL_MASK (AESD_TIMER_WHEEL_SIZE - 1)
+
+static void slot_insert(struct aesd_timer **slot, struct aesd_timer *timer)
+{
+	timer->next = *slot;
+	if (timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+/**
+* Initializes @param wheel to an empty wheel whose next tick to process is @param now
+*/
+void aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(struct aesd_timer_wheel));
+	wheel->now = now;
+}
+
+/**
+* Arms @param timer to fire on tick @param expires. A tick that already passed fires on the next advance.
+* The timer must not be pending
+*/
+void aesd_timer_add(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, uint64_t expires)
+{
+	timer->expires = expires;
+	if (expires < wheel->now)
+		expires = wheel->now; // overdue
+	uint64_t delta = expires - wheel->now;
+	int level = 0;
+	while (level < AESD_TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (AESD_TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	if (delta >= (1ULL << (AESD_TIMER_WHEEL_BITS * AESD_TIMER_WHEEL_LEVELS)))
+		expires = wheel->now + (1ULL << (AESD_TIMER_WHEEL_BITS * AESD_TIMER_WHEEL_LEVELS)) - 1; // re-cascaded later
+	slot_insert(&wheel->slot[level][(expires >> (AESD_TIMER_WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+/**
+* Disarms @param timer. Safe to call on a timer that is not pending
+*/
+void aesd_timer_del(struct aesd_timer *timer)
+{
+	if (timer->pprev == NULL)
+		return;
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+// Move every timer of slot `index` of `level` down to the levels below. Returns `index`
+static int cascade(struct aesd_timer_wheel *wheel, int level, int index)
+{
+	struct aesd_timer *timer = wheel->slot[level][index];
+	wheel->slot[level][index] = NULL;
+	while (timer != NULL)
+	{
+		struct aesd_timer *next = timer->next;
+		timer->pprev = NULL;
+		aesd_timer_add(wheel, timer, timer->expires);
+		timer = next;
+	}
+	return index;
+}
+
+/**
+* Processes every tick of @param wheel up to and including @param now, calling the callback of each timer that expires
+*/
+void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now)
+{
+	while (wheel->now <= now)
+	{
+		int index = wheel->now & WHEEL_MASK;
+		// Level 0 wrapped around: pull the next slice of each upper level down, as far up as the wrap goes
+		for (int level = 1; index == 0 && level < AESD_TIMER_WHEEL_LEVELS; level++)
+		{
+			if (cascade(wheel, level, (wheel->now >> (AESD_TIMER_WHEEL_BITS * level)) & WHEEL_MASK) != 0)
+				break;
+		}
+		wheel->now++; // timers re-added by a callback land on a later tick
+		struct aesd_timer *timer;
+		while ((timer = wheel->slot[0][index]) != NULL)
+		{
+			aesd_timer_del(timer);
+			timer->fn(timer);
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * aesd-timer-wheel.h
+ *
+ * Hierarchical timer wheel driven by an external tick (a timerfd in aesdsocket)
+ */
+
+#ifndef AESD_TIMER_WHEEL_H
+#define AESD_TIMER_WHEEL_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+
+#define AESD_TIMER_WHEEL_BITS 6 // 64 slots per level
+#define AESD_TIMER_WHEEL_SIZE (1 << AESD_TIMER_WHEEL_BITS)
+#define AESD_TIMER_WHEEL_LEVELS 4 // 64^4 ticks before a timer has to be re-cascaded from the last level
+
+struct aesd_timer
+{
+    /**
+     * Called from aesd_timer_wheel_advance once the timer expires. The timer is no longer pending at that point and
+     * may be re-added from the callback
+     */
+    void (*fn)(struct aesd_timer *timer);
+    /**
+     * Free for the owner of the timer, eg. to find its connection
+     */
+    void *data;
+    /**
+     * Tick at which the timer expires
+     */
+    uint64_t expires;
+    /**
+     * Links of the slot list. pprev is NULL when the timer is not pending
+     */
+    struct aesd_timer *next;
+    struct aesd_timer **pprev;
+};
+
+struct aesd_timer_wheel
+{
+    /**
+     * The next tick to be processed. Everything before it has fired
+     */
+    uint64_t now;
+    /**
+     * Level n slot i holds the timers expiring in the 64^n ticks slice selected by i
+     */
+    struct aesd_timer *slot[AESD_TIMER_WHEEL_LEVELS][AESD_TIMER_WHEEL_SIZE];
+};
+
+extern void aesd_timer_wheel_init(struct aesd_timer_wheel *wheel, uint64_t now);
+
+extern void aesd_timer_add(struct aesd_timer_wheel *wheel, struct aesd_timer *timer, uint64_t expires);
+
+extern void aesd_timer_del(struct aesd_timer *timer);
+
+extern void aesd_timer_wheel_advance(struct aesd_timer_wheel *wheel, uint64_t now);
+
+static inline bool aesd_timer_pending(const struct aesd_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif /* AESD_TIMER_WHEEL_H */
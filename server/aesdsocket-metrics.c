@@ -0,0 +1,332 @@
+/**
+ * @file aesdsocket-metrics.c
+ * @brief Hot path counters of aesdsocket, scraped in the Prometheus text format
+ *
+ * Counters live in cache line aligned shards. A thread picks a shard the first time it counts something and keeps
+ * it, so threads do not bounce each other's cache lines as long as there are fewer threads than shards. Updates are
+ * relaxed atomics since a shard may still be shared. A scrape adds the shards up.
+ * The endpoint is a local TCP port or a Unix domain socket served by a thread of its own, so a slow scraper never
+ * holds up the connections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+
+#define METRICS_SHARDS 64
+#define HIST_BUCKETS 10 // upper bounds 1 us * 4^i, plus +Inf
+
+struct metrics_shard
+{
+	_Atomic uint64_t counter[M_COUNTERS];
+	_Atomic uint64_t bucket[H_COUNT][HIST_BUCKETS + 1];
+	_Atomic uint64_t sum_ns[H_COUNT];
+} __attribute__((aligned(64)));
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static _Atomic unsigned next_shard;
+static __thread struct metrics_shard *my_shard;
+
+bool metrics_on = false;
+static int msfd = -1; // metrics server socket
+static char *msun_path; // path of msfd when it is a Unix domain socket
+static pthread_t metrics_thread;
+
+static const struct
+{
+	const char *name;
+	const char *type;
+	const char *help;
+} counter_info[M_COUNTERS] =
+{
+	[M_ACCEPTED] = { "aesdsocket_connections_accepted_total", "counter", "Connections accepted" },
+	[M_CLOSED] = { "aesdsocket_connections_closed_total", "counter", "Connections closed" },
+	[M_PACKETS] = { "aesdsocket_packets_total", "counter", "Packets appended to the store" },
+	[M_BYTES_IN] = { "aesdsocket_received_bytes_total", "counter", "Bytes received from clients" },
+	[M_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "counter", "Bytes sent to clients" },
+	[M_REPLAY_BYTES] = { "aesdsocket_replay_bytes_total", "counter", "Bytes of history queued as replies" },
+	[M_LOCK_WAIT_NS] = { "aesdsocket_store_lock_wait_seconds_total", "counter", "Time spent waiting for fd_m" },
+	[M_LOCK_ACQUIRED] = { "aesdsocket_store_lock_acquisitions_total", "counter", "Acquisitions of fd_m" },
+};
+
+static const struct
+{
+	const char *name;
+	const char *help;
+} hist_info[H_COUNT] =
+{
+	[H_APPEND] = { "aesdsocket_append_duration_seconds", "Time to append a packet to the store" },
+	[H_REPLAY] = { "aesdsocket_replay_duration_seconds", "Time from a reply being queued to its last byte being sent" },
+};
+
+static struct metrics_shard *shard (void)
+{
+	if (my_shard == NULL)
+		my_shard = &shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % METRICS_SHARDS];
+	return my_shard;
+}
+
+void metric_add (enum metric m, uint64_t v)
+{
+	if (metrics_on)
+		atomic_fetch_add_explicit(&shard()->counter[m], v, memory_order_relaxed);
+}
+
+void metric_observe (enum metric_hist h, uint64_t start_ns)
+{
+	if (metrics_on == false || start_ns == 0)
+		return;
+	uint64_t ns = metrics_now() - start_ns;
+	int i = 0;
+	uint64_t bound = 1000;
+	while (i < HIST_BUCKETS && ns > bound)
+	{
+		i++;
+		bound *= 4;
+	}
+	struct metrics_shard *s = shard();
+	atomic_fetch_add_explicit(&s->bucket[h][i], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->sum_ns[h], ns, memory_order_relaxed);
+}
+
+uint64_t metrics_now (void)
+{
+	if (metrics_on == false)
+		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void store_lock (void)
+{
+	if (metrics_on == false)
+	{
+		pthread_mutex_lock(&fd_m);
+		return;
+	}
+	if (pthread_mutex_trylock(&fd_m) != 0)
+	{
+		// Contended. Only then is the wait worth two clock reads
+		uint64_t t0 = metrics_now();
+		pthread_mutex_lock(&fd_m);
+		metric_add(M_LOCK_WAIT_NS, metrics_now() - t0);
+	}
+	metric_add(M_LOCK_ACQUIRED, 1);
+}
+
+void store_unlock (void)
+{
+	pthread_mutex_unlock(&fd_m);
+}
+
+// Render every metric into a malloc'd buffer
+static char *render (size_t *len)
+{
+	size_t cap = 8192;
+	char *buf = (char *) malloc(cap);
+	if (buf == NULL)
+		return NULL;
+	size_t n = 0;
+#define OUT(...) n += snprintf(buf + n, n < cap ? cap - n : 0, __VA_ARGS__)
+	for (int m = 0; m < M_COUNTERS; m++)
+	{
+		uint64_t v = 0;
+		for (int s = 0; s < METRICS_SHARDS; s++)
+			v += atomic_load_explicit(&shards[s].counter[m], memory_order_relaxed);
+		OUT("# HELP %s %s\n# TYPE %s %s\n", counter_info[m].name, counter_info[m].help, counter_info[m].name,
+			counter_info[m].type);
+		if (m == M_LOCK_WAIT_NS)
+			OUT("%s %.9f\n", counter_info[m].name, v / 1e9);
+		else
+			OUT("%s %llu\n", counter_info[m].name, (unsigned long long) v);
+		if (m == M_CLOSED)
+		{
+			uint64_t accepted = 0;
+			for (int s = 0; s < METRICS_SHARDS; s++)
+				accepted += atomic_load_explicit(&shards[s].counter[M_ACCEPTED], memory_order_relaxed);
+			// The shards are read one after the other, so a connection may be seen closed but not accepted yet
+			OUT("# HELP aesdsocket_connections_active Connections open\n# TYPE aesdsocket_connections_active gauge\n"
+				"aesdsocket_connections_active %llu\n", (unsigned long long) (accepted > v ? accepted - v : 0));
+		}
+	}
+	size_t held, stored;
+	pthread_mutex_lock(&fd_m); // not store_lock: a scrape is not store traffic
+	bool known = store->occupancy != NULL && store->occupancy(&held, &stored);
+	pthread_mutex_unlock(&fd_m);
+	if (known)
+	{
+		OUT("# HELP aesdsocket_store_held_bytes Bytes of history held, uncompressed\n"
+			"# TYPE aesdsocket_store_held_bytes gauge\naesdsocket_store_held_bytes %zu\n", held);
+		OUT("# HELP aesdsocket_store_stored_bytes Memory used by the history held\n"
+			"# TYPE aesdsocket_store_stored_bytes gauge\naesdsocket_store_stored_bytes %zu\n", stored);
+		OUT("# HELP aesdsocket_store_compression_ratio Held over stored bytes\n"
+			"# TYPE aesdsocket_store_compression_ratio gauge\naesdsocket_store_compression_ratio %.3f\n",
+			stored == 0 ? 1.0 : (double) held / stored);
+	}
+	for (int h = 0; h < H_COUNT; h++)
+	{
+		OUT("# HELP %s %s\n# TYPE %s histogram\n", hist_info[h].name, hist_info[h].help, hist_info[h].name);
+		uint64_t cumulative = 0;
+		uint64_t sum = 0;
+		uint64_t bound = 1000;
+		for (int i = 0; i <= HIST_BUCKETS; i++, bound *= 4)
+		{
+			for (int s = 0; s < METRICS_SHARDS; s++)
+				cumulative += atomic_load_explicit(&shards[s].bucket[h][i], memory_order_relaxed);
+			if (i < HIST_BUCKETS)
+				OUT("%s_bucket{le=\"%g\"} %llu\n", hist_info[h].name, bound / 1e9, (unsigned long long) cumulative);
+			else
+				OUT("%s_bucket{le=\"+Inf\"} %llu\n", hist_info[h].name, (unsigned long long) cumulative);
+		}
+		for (int s = 0; s < METRICS_SHARDS; s++)
+			sum += atomic_load_explicit(&shards[s].sum_ns[h], memory_order_relaxed);
+		OUT("%s_sum %.9f\n%s_count %llu\n", hist_info[h].name, sum / 1e9, hist_info[h].name,
+			(unsigned long long) cumulative);
+	}
+#undef OUT
+	*len = n < cap ? n : cap - 1; // cap is sized well beyond what the metrics above print
+	return buf;
+}
+
+// Answer one scrape. An HTTP request gets an HTTP response; anything else, or nothing within a second, gets the bare
+// text so that `nc` works too
+static void serve_scrape (int cfd)
+{
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char req[1024];
+	ssize_t r = recv(cfd, req, sizeof(req), 0);
+	size_t len;
+	char *body = render(&len);
+	if (body == NULL)
+		return;
+	if (r >= 4 && memcmp(req, "GET ", 4) == 0)
+	{
+		char hdr[160];
+		int hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", len);
+		send(cfd, hdr, hlen, MSG_NOSIGNAL);
+	}
+	for (size_t off = 0; off < len; )
+	{
+		ssize_t n = send(cfd, body + off, len - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	free(body);
+}
+
+static void *metrics_func (void *arg)
+{
+	while (is_terminated == false)
+	{
+		int cfd = accept(msfd, NULL, NULL);
+		if (cfd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break; // shut down by metrics_stop
+		}
+		serve_scrape(cfd);
+		close(cfd);
+	}
+	return NULL;
+}
+
+int metrics_start (const char *where)
+{
+	if (where[0] == '/')
+	{
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(where) >= sizeof(sun.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(sun.sun_path, where);
+		msfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct stat st;
+		if (lstat(where, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(where); // left by a previous run
+		if (msfd == -1 || bind(msfd, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+			goto fail;
+		msun_path = strdup(where);
+	}
+	else
+	{
+		// Local scrapers only
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo *ai;
+		int ret = getaddrinfo("127.0.0.1", where, &hints, &ai);
+		if (ret != 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		msfd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		const int enable = 1;
+		if (msfd != -1)
+			setsockopt(msfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+		ret = msfd == -1 ? -1 : bind(msfd, ai->ai_addr, ai->ai_addrlen);
+		freeaddrinfo(ai);
+		if (ret == -1)
+			goto fail;
+	}
+	if (listen(msfd, 8) == -1)
+		goto fail;
+	metrics_on = true;
+	sigset_t term, old;
+	sigemptyset(&term);
+	sigaddset(&term, SIGINT);
+	sigaddset(&term, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &term, &old); // signals are for main
+	int ret = pthread_create(&metrics_thread, NULL, metrics_func, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret == 0)
+		return 0;
+	metrics_on = false;
+	errno = ret;
+fail:
+	{
+		int err = errno;
+		if (msfd != -1)
+			close(msfd);
+		msfd = -1;
+		errno = err;
+	}
+	return -1;
+}
+
+void metrics_stop (void)
+{
+	if (msfd == -1)
+		return;
+	shutdown(msfd, SHUT_RDWR); // accept fails and the thread returns
+	pthread_join(metrics_thread, NULL);
+	close(msfd);
+	msfd = -1;
+	if (msun_path != NULL)
+	{
+		unlink(msun_path);
+		free(msun_path);
+		msun_path = NULL;
+	}
+}
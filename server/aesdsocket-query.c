@@ -0,0 +1,121 @@
+/**
+ * @file aesdsocket-query.c
+ * @brief Filtered replays: the lines of the history that contain a string, or its last lines
+ *
+ * A query reads the history like a replay does, through the data file mapping or a copy of the store taken under
+ * fd_m, but scans it without the lock, with the substring search of aesd-memmem.h. The line around a hit is copied
+ * out and the search resumes after it, so that a line is only reported once.
+ */
+
+#define _GNU_SOURCE // memmem, memrchr
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "aesdsocket.h"
+#include "aesd-memmem.h"
+
+bool parse_query_cmd (const char *pkt, size_t len, struct query *q)
+{
+	const size_t grep_len = sizeof(GREP_CMD) - 1;
+	const size_t tail_len = sizeof(TAIL_CMD) - 1;
+	if (len > 0 && pkt[len - 1] == '\n')
+		len--;
+	if (len >= grep_len && memcmp(pkt, GREP_CMD, grep_len) == 0)
+	{
+		q->kind = QUERY_GREP;
+		q->pattern_len = len - grep_len; // fits: packets are at most PKT_MAX bytes
+		memcpy(q->pattern, pkt + grep_len, q->pattern_len);
+		return true;
+	}
+	if (len > tail_len && memcmp(pkt, TAIL_CMD, tail_len) == 0)
+	{
+		char num[32]; // the packet is not null terminated
+		size_t n = len - tail_len < sizeof(num) ? len - tail_len : sizeof(num) - 1;
+		memcpy(num, pkt + tail_len, n);
+		num[n] = '\0';
+		char *end;
+		errno = 0;
+		unsigned long long lines = strtoull(num, &end, 10);
+		if (end == num || errno != 0 || *end != '\0')
+			return false; // malformed commands are stored like any other packet
+		q->kind = QUERY_TAIL;
+		q->lines = lines;
+		return true;
+	}
+	return false;
+}
+
+// First occurrence of the pattern of `q` in [p, end), or NULL
+static const char *find (const struct query *q, const char *p, const char *end)
+{
+	return aesd_memmem(p, end - p, q->pattern, q->pattern_len);
+}
+
+// Lines of `data` containing the pattern, in a malloc'd buffer
+static char *grep (const struct query *q, const char *data, size_t len, size_t *out_len)
+{
+	size_t cap = len < 65536 ? len + 1 : 65536;
+	char *out = (char *) malloc(cap);
+	if (out == NULL)
+		return NULL;
+	*out_len = 0;
+	const char *p = data;
+	const char *end = data + len;
+	const char *hit;
+	while (p < end && (hit = q->pattern_len == 0 ? p : find(q, p, end)) != NULL)
+	{
+		const char *bol = memrchr(p, '\n', hit - p);
+		bol = bol == NULL ? p : bol + 1;
+		const char *eol = (const char *) memchr(hit, '\n', end - hit);
+		eol = eol == NULL ? end : eol + 1; // the line and its newline, if it has one
+		size_t n = eol - bol;
+		if (*out_len + n > cap)
+		{
+			size_t bigger = cap * 2 >= *out_len + n ? cap * 2 : *out_len + n;
+			char *grown = (char *) realloc(out, bigger);
+			if (grown == NULL)
+			{
+				free(out);
+				return NULL;
+			}
+			out = grown;
+			cap = bigger;
+		}
+		memcpy(out + *out_len, bol, n);
+		*out_len += n;
+		p = eol;
+	}
+	return out;
+}
+
+// Start of the last `lines` lines of `data`. A last line without a newline counts
+static const char *tail (size_t lines, const char *data, size_t len)
+{
+	const char *end = data + len;
+	if (len > 0 && end[-1] == '\n')
+		end--; // the newline of the last line does not start a line
+	while (lines > 0)
+	{
+		const char *nl = (const char *) memrchr(data, '\n', end - data);
+		if (nl == NULL)
+			return data; // fewer lines than asked for
+		if (--lines == 0)
+			return nl + 1;
+		end = nl;
+	}
+	return data + len;
+}
+
+const char *query_run (const struct query *q, const char *data, size_t len, size_t *out_len, char **owned)
+{
+	*owned = NULL;
+	if (q->kind == QUERY_TAIL)
+	{
+		const char *start = tail(q->lines, data, len);
+		*out_len = data + len - start;
+		return start;
+	}
+	*owned = grep(q, data, len, out_len);
+	return *owned;
+}
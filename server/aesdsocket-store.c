@@ -0,0 +1,356 @@
+/**
+ * @file aesdsocket-store.c
+ * @brief Storage backends of aesdsocket, selected at runtime with -s
+ *
+ *  - file: a regular file, replayed from a shared mmap window
+ *  - chardev: the aesdchar driver, which only keeps its last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED writes
+ *  - ring: the circular buffer of the driver linked into the process. Same retention as chardev, without a syscall
+ *  - ring-lz4: ring with every entry LZ4 compressed when that makes it smaller
+ * Offsets are those of the whole stream of appends: a backend that forgets old data keeps the window
+ * [data_len - bytes held, data_len) and clamps the copies to it. Every call is made with fd_m held.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "aesdsocket.h"
+#include "aesd-circular-buffer.h"
+
+#define STORE_FILE_NAME "/var/tmp/aesdsocketdata"
+#define STORE_CHARDEV_NAME "/dev/aesdchar"
+
+#define MAP_WINDOW_MIN (1UL << 24) // reserve at least 16 MiB of address space for the data file mapping
+
+int fd = -1; // fd of the file or device backend
+
+/* file */
+
+// A read-only shared mapping of the data file. The window is reserved larger than the file so that it grows with the
+// file for free; pages past EOF are never touched because readers stop at data_len
+struct data_map
+{
+	char *addr; // start of the mapping. MAP_FAILED if the file cannot be mmapped
+	size_t len; // length of the reserved window
+	struct data_map *prev; // older, smaller windows. Kept mapped until exit since a reader may still be sending from them
+};
+static struct data_map *dmap = NULL; // current window
+
+static int file_open (void)
+{
+	fd = open(STORE_FILE_NAME, O_APPEND | O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return -1;
+	struct stat st;
+	data_len = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0; // the file may survive a crash
+	return 0;
+}
+
+static ssize_t fd_append (const char *buf, size_t len)
+{
+	return write(fd, buf, len); // one write keeps a record in one piece
+}
+
+static ssize_t fd_appendv (const struct iovec *iov, int iovcnt)
+{
+	return writev(fd, iov, iovcnt); // the driver reassembles a record written in pieces
+}
+
+static const char *file_map (size_t len)
+{
+	if (dmap != NULL && (dmap->addr == MAP_FAILED || len <= dmap->len))
+		return dmap->addr == MAP_FAILED ? NULL : dmap->addr; // common case: the committed length still fits in the window
+	size_t win = dmap == NULL ? MAP_WINDOW_MIN : dmap->len;
+	while (win < len)
+		win *= 2; // grow geometrically so that remaps are rare
+	struct data_map *m = (struct data_map *) malloc(sizeof(struct data_map));
+	if (m == NULL)
+		return NULL;
+	m->addr = mmap(NULL, win, PROT_READ, MAP_SHARED, fd, 0);
+	m->len = win;
+	m->prev = dmap;
+	dmap = m;
+	if (m->addr == MAP_FAILED)
+	{
+		aesd_log(LOG_INFO, "%s cannot be mmapped (%s). Falling back to read()", STORE_FILE_NAME, strerror(errno));
+		return NULL;
+	}
+	return m->addr;
+}
+
+static char *file_copy (size_t from, size_t to, size_t *len)
+{
+	char *copy = (char *) malloc(to - from + 1); // +1 so that an empty range is not mistaken for a failure
+	if (copy == NULL)
+		return NULL;
+	size_t pos = from;
+	ssize_t n;
+	while (pos < to && (n = pread(fd, copy + (pos - from), to - pos, pos)) > 0)
+		pos += n;
+	*len = pos - from;
+	return copy;
+}
+
+static void file_close (bool keep)
+{
+	while (dmap != NULL)
+	{
+		struct data_map *m = dmap;
+		dmap = m->prev;
+		if (m->addr != MAP_FAILED)
+			munmap(m->addr, m->len);
+		free(m);
+	}
+	close(fd);
+	fd = -1;
+	if (keep == false)
+		unlink(STORE_FILE_NAME); // delete the file
+}
+
+/* chardev */
+
+// Read everything the device holds into a malloc'd buffer. Returns NULL on failure
+static char *chardev_read_all (size_t *held)
+{
+	size_t cap = 65536; // in big reads: the driver copies out as much as it holds per call
+	char *buf = (char *) malloc(cap);
+	if (buf == NULL || lseek(fd, 0, SEEK_SET) == (off_t) -1)
+	{
+		free(buf);
+		return NULL;
+	}
+	*held = 0;
+	ssize_t n;
+	while ((n = read(fd, buf + *held, cap - *held)) > 0)
+	{
+		*held += n;
+		if (*held == cap)
+		{
+			char *grown = (char *) realloc(buf, cap * 2);
+			if (grown == NULL)
+				break;
+			buf = grown;
+			cap *= 2;
+		}
+	}
+	return buf;
+}
+
+static int chardev_open (void)
+{
+	fd = open(STORE_CHARDEV_NAME, O_RDWR | O_APPEND);
+	if (fd == -1)
+		return -1;
+	size_t held = 0;
+	free(chardev_read_all(&held));
+	data_len = held; // whatever the device holds counts as the start of the stream
+	return 0;
+}
+
+// The device cannot tell how much it holds without being read, so the whole of it is read and the end of what it
+// holds is taken as data_len
+static char *chardev_copy (size_t from, size_t to, size_t *len)
+{
+	size_t held;
+	char *all = chardev_read_all(&held);
+	if (all == NULL)
+		return NULL;
+	size_t start = held < data_len ? data_len - held : 0; // stream offset of all[0]
+	if (from < start)
+		from = start; // forgotten by the device
+	if (to > start + held)
+		to = start + held;
+	*len = from < to ? to - from : 0;
+	memmove(all, all + (from - start), *len);
+	return all;
+}
+
+static void chardev_close (bool keep)
+{
+	close(fd);
+	fd = -1;
+}
+
+/* ring */
+
+static struct aesd_circular_buffer ring;
+static size_t ring_held; // bytes held by the entries of ring, uncompressed
+static bool ring_lz4 = false; // compress the entries
+static char *lz4_workmem; // scratch of the compressor
+static char *lz4_scratch; // an entry decompressed, to copy part of it
+static size_t lz4_scratch_len;
+
+static int ring_open (void)
+{
+	ring_lz4 = false;
+	aesd_circular_buffer_init(&ring);
+	ring_held = 0;
+	data_len = 0;
+	return 0;
+}
+
+static int ring_lz4_open (void)
+{
+	lz4_workmem = (char *) malloc(AESD_LZ4_WORKMEM);
+	if (lz4_workmem == NULL)
+		return -1;
+	ring_open();
+	ring_lz4 = true;
+	return 0;
+}
+
+static ssize_t ring_append (const char *buf, size_t len)
+{
+	if (len == 0)
+		return 0; // like a write of nothing: no entry, so nothing held is evicted
+	size_t cap = ring_lz4 ? AESD_LZ4_COMPRESS_BOUND(len) : len;
+	char *copy = (char *) malloc(cap);
+	if (copy == NULL)
+		return -1;
+	size_t csize = ring_lz4 ? aesd_circular_buffer_compress(buf, len, copy, cap, lz4_workmem) : 0;
+	if (csize != 0)
+	{
+		char *smaller = (char *) realloc(copy, csize);
+		if (smaller != NULL)
+			copy = smaller;
+	}
+	else
+		memcpy(copy, buf, len);
+	if (ring.full)
+	{
+		// aesd_circular_buffer_add_entry overwrites the oldest entry, which is at in_offs once the ring is full
+		struct aesd_buffer_entry *oldest = &ring.entry[ring.in_offs];
+		ring_held -= oldest->size;
+		free((char *) oldest->buffptr);
+	}
+	struct aesd_buffer_entry entry = { .buffptr = copy, .size = len, .compressed_size = csize };
+	aesd_circular_buffer_add_entry(&ring, &entry);
+	ring_held += len;
+	return len;
+}
+
+static ssize_t ring_appendv (const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	char *buf = (char *) malloc(len + 1);
+	if (buf == NULL)
+		return -1;
+	size_t off = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	ssize_t ret = ring_append(buf, len); // one entry
+	free(buf);
+	return ret;
+}
+
+static char *ring_copy (size_t from, size_t to, size_t *len)
+{
+	size_t start = data_len - ring_held; // stream offset of the oldest byte held
+	if (from < start)
+		from = start;
+	char *copy = (char *) malloc(to - from + 1); // +1 so that an empty range is not mistaken for a failure
+	if (copy == NULL)
+		return NULL;
+	*len = 0;
+	size_t off;
+	struct aesd_buffer_entry *e = aesd_circular_buffer_find_entry_offset_for_fpos(&ring, from - start, &off);
+	if (e == NULL)
+		return copy; // nothing to copy
+	size_t index = e - ring.entry;
+	while (*len < to - from)
+	{
+		e = &ring.entry[index];
+		size_t take = e->size - off < to - from - *len ? e->size - off : to - from - *len;
+		if (e->compressed_size != 0 && (off != 0 || take != e->size) && lz4_scratch_len < e->size)
+		{
+			// Part of a compressed entry: it is decompressed whole into the scratch buffer first
+			char *bigger = (char *) realloc(lz4_scratch, e->size);
+			if (bigger == NULL)
+				break;
+			lz4_scratch = bigger;
+			lz4_scratch_len = e->size;
+		}
+		if (aesd_circular_buffer_entry_read(e, off, copy + *len, take, lz4_scratch) != take)
+		{
+			aesd_log(LOG_ERR, "Corrupt ring entry of %zu bytes", e->size);
+			break;
+		}
+		*len += take;
+		off = 0;
+		index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	}
+	return copy;
+}
+
+static bool ring_occupancy (size_t *bytes, size_t *stored)
+{
+	struct aesd_circular_buffer_stats stats;
+	aesd_circular_buffer_get_stats(&ring, &stats);
+	*bytes = stats.bytes;
+	*stored = stats.stored_bytes;
+	return true;
+}
+
+static void ring_close (bool keep)
+{
+	uint8_t index;
+	struct aesd_buffer_entry *entry;
+	if (ring_lz4)
+	{
+		struct aesd_circular_buffer_stats stats;
+		aesd_circular_buffer_get_stats(&ring, &stats);
+		aesd_log(LOG_INFO, "The ring held %zu bytes in %zu, compression ratio %u%%", stats.bytes, stats.stored_bytes,
+			stats.ratio_percent);
+	}
+	AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring, index)
+	{
+		free((char *) entry->buffptr);
+	}
+	aesd_circular_buffer_init(&ring);
+	ring_held = 0;
+	free(lz4_workmem);
+	free(lz4_scratch);
+	lz4_workmem = lz4_scratch = NULL;
+	lz4_scratch_len = 0;
+}
+
+const struct store_ops store_backends[] =
+{
+	{ .name = "file", .path = STORE_FILE_NAME, .timestamps = true, .open = file_open, .append = fd_append,
+		.appendv = fd_appendv, .map = file_map, .copy = file_copy, .close = file_close },
+	{ .name = "chardev", .path = STORE_CHARDEV_NAME, .timestamps = false, .open = chardev_open, .append = fd_append,
+		.appendv = fd_appendv, .map = NULL, .copy = chardev_copy, .close = chardev_close },
+	{ .name = "ring", .path = "in-process ring", .timestamps = false, .open = ring_open, .append = ring_append,
+		.appendv = ring_appendv, .map = NULL, .copy = ring_copy, .occupancy = ring_occupancy, .close = ring_close },
+	{ .name = "ring-lz4", .path = "in-process LZ4 ring", .timestamps = false, .open = ring_lz4_open,
+		.append = ring_append, .appendv = ring_appendv, .map = NULL, .copy = ring_copy, .occupancy = ring_occupancy,
+		.close = ring_close },
+	{ .name = NULL },
+};
+
+const struct store_ops *store_find (const char *name)
+{
+	for (const struct store_ops *s = store_backends; s->name != NULL; s++)
+	{
+		if (strcmp(s->name, name) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+const char *map_data_file (size_t len)
+{
+	return store->map != NULL ? store->map(len) : NULL;
+}
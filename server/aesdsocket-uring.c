@@ -0,0 +1,815 @@
+/**
+ * @file aesdsocket-uring.c
+ * @brief io_uring connection engine for aesdsocket, selected at runtime with -u
+ *
+ * A single thread drives every connection through one ring:
+ *  - one multishot accept on sfd (and one on usfd) produces a completion per incoming connection
+ *  - recv picks its memory from a provided buffer ring, so idle connections pin no receive buffer
+ *  - a completed packet sits in a slot of a registered (fixed) buffer slab and is appended with IORING_OP_WRITE_FIXED,
+ *    linked to an IORING_OP_SEND of the whole history straight out of the data file mapping
+ *  - the timerfd is read through the ring and advances the timer wheel on the same thread, and so is sigfd; hfd is
+ *    polled. Once terminated the accepts are cancelled and the connections drained for up to drain_timeout seconds
+ * Appends are issued one at a time so that the file content follows the order in which packets completed. The ring
+ * talks to the kernel through raw syscalls so that there is no liburing dependency.
+ */
+
+#ifdef USE_IO_URING
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+
+#define RING_ENTRIES 256 // submission queue size. The completion queue is twice this
+#define RING_ROOM_TRIES 64 // submits tried on a full SQ before the sqe is given up
+#define MAX_CONNS 1024 // slots in the connection slab
+#define RBUF_COUNT 256 // provided receive buffers. Must be a power of 2
+#define RBUF_SIZE 2048 // size of each provided receive buffer
+#define RBUF_GROUP 0 // buffer group id of the provided buffer ring
+
+enum uring_op
+{
+	OP_ACCEPT = 1,
+	OP_RECV,
+	OP_WRITE,
+	OP_SEND,
+	OP_TIMER,
+	OP_TSWRITE,
+	OP_SIGNAL,
+	OP_HANDOFF,
+	OP_CANCEL,
+};
+
+// user_data of every sqe: the operation in the upper half, the connection slot in the lower half
+#define UD(op, slot) (((uint64_t)(op) << 32) | (uint32_t)(slot))
+#define UD_OP(ud) ((int)((ud) >> 32))
+#define UD_SLOT(ud) ((int)((ud) & 0xffffffff))
+
+// Per-connection state
+struct uconn
+{
+	int sock_fd; // client socket file descriptor. -1 when the slot is free
+	char ip_a[PEER_ADDRSTRLEN]; // addr of the connected client in string representation
+	struct pkt_parser p; // assembles the packet in the registered slab at pkts + slot * PKT_MAX
+	char *rx; // bytes received after the packet in flight (-k), parsed once its replay is done
+	size_t rx_off; // next unparsed byte of rx
+	size_t rx_len; // bytes held in rx
+	bool eof; // the client closed its end
+	bool is_new; // nothing received yet
+	bool is_delta; // replies only carry what was appended since the previous reply
+	size_t sent_off; // offset of the store up to which this client has been sent data
+	const char *send_buf; // start of the reply in the data file mapping, or in send_owned
+	char *send_owned; // malloc'd reply of a GREP_CMD, freed once sent
+	size_t send_off; // bytes of the reply sent so far
+	size_t send_len; // length of the reply
+	uint64_t append_t0; // metrics_now() when the packet was queued for its append
+	uint64_t send_t0; // metrics_now() when the reply was set
+	struct aesd_timer timer; // idle / slow client deadline
+	int next; // link for the free list and the append FIFO
+};
+
+static struct
+{
+	int ring_fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring_ptr; // SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+	size_t ring_sz;
+	size_t sqes_sz;
+	unsigned sq_local_tail; // sqes prepared but not yet handed to the kernel
+	unsigned to_submit;
+
+	struct io_uring_buf_ring *br; // provided buffer ring for recv
+	unsigned short br_tail;
+	char *rbufs; // RBUF_COUNT buffers of RBUF_SIZE bytes backing br
+	char *pkts; // registered slab of MAX_CONNS packet buffers of PKT_MAX bytes
+
+	struct uconn conns[MAX_CONNS];
+	int free_head; // first free slot, -1 when the slab is exhausted
+	int live; // connections open
+	int aq_head, aq_tail; // FIFO of connections waiting for their append. -1 when empty
+	bool append_busy; // an append chain is in flight
+	bool accept_armed[2]; // the multishot accept on sfd, usfd is still live
+	bool running; // uring_engine_run is serving connections
+	uint64_t expirations; // read buffer for tfd
+	struct signalfd_siginfo siginfo; // read buffer for sigfd
+	char ts_rec[128]; // timestamp record waiting for its append
+	size_t ts_len; // 0 when no timestamp record is waiting
+} u;
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter (int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register (int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Hand all prepared sqes to the kernel, and optionally wait for at least one completion
+static int ring_submit (bool wait)
+{
+	__atomic_store_n(u.sq_tail, u.sq_local_tail, __ATOMIC_RELEASE);
+	int ret = sys_io_uring_enter(u.ring_fd, u.to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+	if (ret > 0)
+		u.to_submit -= ret;
+	return ret;
+}
+
+// Make sure `n` sqes can be prepared without an intermediate submit, which would break a link chain
+static bool ring_make_room (unsigned n)
+{
+	bool wait = false;
+	for (int tries = 0; u.sq_local_tail + n - __atomic_load_n(u.sq_head, __ATOMIC_ACQUIRE) > u.sq_entries; tries++)
+	{
+		if (tries == RING_ROOM_TRIES)
+			return false; // the caller retries from a later completion
+		// EBUSY / EAGAIN: the kernel holds completions back until the CQ has room, or is short of resources. Waiting
+		// for a completion flushes them; the main loop has already consumed the cqe being handled
+		if (ring_submit(wait) >= 0)
+			wait = false;
+		else if (errno == EBUSY || errno == EAGAIN)
+			wait = true;
+		else if (errno != EINTR)
+			return false; // SQ full and the kernel refuses to take any
+	}
+	return true;
+}
+
+static struct io_uring_sqe *ring_get_sqe (void)
+{
+	if (ring_make_room(1) == false)
+		return NULL;
+	struct io_uring_sqe *sqe = &u.sqes[u.sq_local_tail & *u.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u.sq_local_tail++;
+	u.to_submit++;
+	return sqe;
+}
+
+// Accept on sfd (which 0) or usfd (which 1)
+static void arm_accept (int which)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = which == 0 ? sfd : usfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT; // one sqe, one cqe per connection until it is cancelled
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = UD(OP_ACCEPT, which);
+	u.accept_armed[which] = true;
+}
+
+static void arm_recv (int slot)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = u.conns[slot].sock_fd;
+	sqe->len = RBUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT; // the kernel picks a buffer from the provided ring when data arrives
+	sqe->buf_group = RBUF_GROUP;
+	sqe->user_data = UD(OP_RECV, slot);
+}
+
+static void arm_send (int slot)
+{
+	struct uconn *c = &u.conns[slot];
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = c->sock_fd;
+	sqe->addr = (uint64_t) (uintptr_t) (c->send_buf + c->send_off);
+	sqe->len = c->send_len - c->send_off;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = UD(OP_SEND, slot);
+}
+
+// Give receive buffer `bid` back to the kernel
+static void recycle_rbuf (unsigned short bid)
+{
+	struct io_uring_buf *b = &u.br->bufs[u.br_tail & (RBUF_COUNT - 1)];
+	b->addr = (uint64_t) (uintptr_t) (u.rbufs + (size_t) bid * RBUF_SIZE);
+	b->len = RBUF_SIZE;
+	b->bid = bid;
+	u.br_tail++;
+	__atomic_store_n(&u.br->tail, u.br_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_timer (void)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = tfd;
+	sqe->addr = (uint64_t) (uintptr_t) &u.expirations;
+	sqe->len = sizeof(u.expirations);
+	sqe->user_data = UD(OP_TIMER, 0);
+}
+
+static void arm_signal (void)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = sigfd;
+	sqe->addr = (uint64_t) (uintptr_t) &u.siginfo;
+	sqe->len = sizeof(u.siginfo);
+	sqe->user_data = UD(OP_SIGNAL, 0);
+}
+
+static void arm_handoff (void)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = hfd;
+	sqe->poll32_events = POLLIN; // accepted by main once the connections are drained
+	sqe->user_data = UD(OP_HANDOFF, 0);
+}
+
+// Stop accepting. The listening sockets stay open, so clients that connect from now on wait in their backlog
+static void cancel_accept (int which)
+{
+	if (u.accept_armed[which] == false)
+		return;
+	struct io_uring_sqe *sqe = ring_get_sqe();
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = UD(OP_ACCEPT, which);
+	sqe->user_data = UD(OP_CANCEL, which);
+}
+
+static void close_conn (int slot)
+{
+	struct uconn *c = &u.conns[slot];
+	conn_timer_disarm(&c->timer); // before the socket it points to is closed
+	close(c->sock_fd);
+	aesd_log_conn(AESD_LOG_CLOSE, c->sock_fd, c->ip_a);
+	metric_add(M_CLOSED, 1);
+	u.live--;
+	c->sock_fd = -1;
+	free(c->rx);
+	c->rx = NULL;
+	free(c->send_owned);
+	c->send_owned = NULL;
+	c->next = u.free_head;
+	u.free_head = slot;
+}
+
+// Length of the history the file already holds. data_len also counts the appends in flight, whose pages may not be
+// written yet: a reply that is not linked to the append must stop here. Caller holds fd_m
+static size_t written_len (void)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 && (size_t) st.st_size < data_len ? (size_t) st.st_size : data_len;
+}
+
+// Point the reply of `c` at the first `len` bytes of history it has to be sent: all of them, or in delta mode what was
+// appended since its previous reply. Caller holds fd_m
+static void set_reply (struct uconn *c, size_t len)
+{
+	size_t from = c->is_delta ? c->sent_off : 0;
+	c->send_buf = map_data_file(len) + from;
+	c->send_len = len - from;
+	c->send_off = 0;
+	c->sent_off = len;
+	c->send_t0 = metrics_now();
+	metric_add(M_REPLAY_BYTES, c->send_len);
+}
+
+// Append the packet of the connection at the head of the FIFO, linked to the replay of the resulting history
+static void start_append (void)
+{
+	if (u.append_busy)
+		return;
+	if (u.ts_len > 0)
+	{
+		// A timestamp record goes first. It is not linked to any reply
+		struct io_uring_sqe *sqe = ring_get_sqe();
+		if (sqe == NULL)
+			return;
+		store_lock();
+		data_len += u.ts_len;
+		map_data_file(data_len);
+		store_unlock();
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t) (uintptr_t) u.ts_rec;
+		sqe->len = u.ts_len;
+		sqe->off = (uint64_t) -1; // the data file is O_APPEND
+		sqe->user_data = UD(OP_TSWRITE, 0);
+		u.append_busy = true;
+		return;
+	}
+	if (u.aq_head == -1)
+		return;
+	if (ring_make_room(2) == false)
+		return; // SQ full. The connection stays at the head of the FIFO until the next completion retries it
+	int slot = u.aq_head;
+	struct uconn *c = &u.conns[slot];
+	u.aq_head = c->next;
+	if (u.aq_head == -1)
+		u.aq_tail = -1;
+
+	store_lock();
+	data_len += c->p.len; // committed once the write completes. Only this thread appends while the ring runs
+	set_reply(c, data_len); // the send is linked to the write, and nothing else is in flight
+	store_unlock();
+	metric_add(M_PACKETS, 1);
+
+	struct io_uring_sqe *sqe = ring_get_sqe(); // room was made above
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) c->p.buf;
+	sqe->len = c->p.len;
+	sqe->off = (uint64_t) -1; // the data file is O_APPEND
+	sqe->buf_index = 0; // the whole slab is registered as buffer 0
+	sqe->flags = IOSQE_IO_LINK; // the replay only starts once the packet is in the file
+	sqe->user_data = UD(OP_WRITE, slot);
+	arm_send(slot);
+	conn_timer_arm(&c->timer, send_timeout);
+	u.append_busy = true;
+}
+
+static void queue_append (int slot)
+{
+	u.conns[slot].next = -1;
+	u.conns[slot].append_t0 = metrics_now();
+	if (u.aq_tail == -1)
+		u.aq_head = slot;
+	else
+		u.conns[u.aq_tail].next = slot;
+	u.aq_tail = slot;
+	start_append();
+}
+
+static void handle_accept (struct io_uring_cqe *cqe, int which)
+{
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		u.accept_armed[which] = false; // the multishot was terminated. Re-armed by the main loop
+	if (cqe->res < 0)
+	{
+		if (is_terminated == false)
+			aesd_log(LOG_ERR, "Failure to accept connection: %s", strerror(-cqe->res));
+		return;
+	}
+	int cfd = cqe->res;
+	if (u.free_head == -1)
+	{
+		aesd_log(LOG_ERR, "Connection slab exhausted, dropping connection");
+		close(cfd);
+		return;
+	}
+	int slot = u.free_head;
+	struct uconn *c = &u.conns[slot];
+	u.free_head = c->next;
+	c->sock_fd = cfd;
+	c->p.buf = u.pkts + (size_t) slot * PKT_MAX;
+	c->p.len = 0;
+	c->p.discarding = false;
+	c->rx_off = c->rx_len = 0;
+	c->eof = false;
+	c->is_new = true;
+	c->is_delta = false;
+	c->sent_off = 0;
+	conn_timer_init(&c->timer, cfd);
+	conn_timer_arm(&c->timer, idle_timeout);
+	struct sockaddr_storage inc_sock;
+	socklen_t inc_sock_size = sizeof(inc_sock);
+	if (getpeername(cfd, (struct sockaddr *) &inc_sock, &inc_sock_size) == 0)
+		peer_name(&inc_sock, c->ip_a);
+	else
+		strcpy(c->ip_a, "?");
+	aesd_log_conn(AESD_LOG_ACCEPT, cfd, c->ip_a);
+	metric_add(M_ACCEPTED, 1);
+	u.live++;
+	arm_recv(slot);
+}
+
+static void dispatch_packet (int slot);
+
+// Parse the packet out of `n` bytes of `data`. Bytes received after a complete packet are kept in c->rx (-k) until its
+// replay is done, since a connection only has one packet in flight. `saved` is set when `data` points into c->rx
+static void parse_packet (int slot, const char *data, size_t n, bool saved)
+{
+	struct uconn *c = &u.conns[slot];
+	bool complete = false;
+	size_t used = 0;
+	while (complete == false && used < n)
+		used += pkt_parse(&c->p, data + used, n - used, &complete); // more than one call after an over-length packet
+	if (saved)
+		c->rx_off += used;
+	if (complete == false)
+	{
+		arm_recv(slot); // everything was consumed
+		return;
+	}
+	if (saved == false && keep_alive && used < n)
+	{
+		if (c->rx == NULL)
+			c->rx = (char *) malloc(RBUF_SIZE);
+		if (c->rx != NULL)
+		{
+			memcpy(c->rx, data + used, n - used);
+			c->rx_off = 0;
+			c->rx_len = n - used;
+		}
+	}
+	dispatch_packet(slot);
+}
+
+// Answer the complete packet of the connection at `slot` as handle_packet does: a query or a DELTA_CMD is replied to
+// from the file, anything else is appended
+static void dispatch_packet (int slot)
+{
+	struct uconn *c = &u.conns[slot];
+	struct query q;
+	if (parse_query_cmd(c->p.buf, c->p.len, &q))
+	{
+		// Not stored. Only what the file already holds is scanned
+		store_lock();
+		size_t len = written_len();
+		const char *base = map_data_file(len);
+		store_unlock();
+		size_t reply_len = 0;
+		const char *reply = base == NULL ? NULL : query_run(&q, base, len, &reply_len, &c->send_owned);
+		if (reply == NULL)
+		{
+			close_conn(slot); // out of memory
+			return;
+		}
+		c->send_buf = reply;
+		c->send_len = reply_len;
+		c->send_off = 0;
+		c->send_t0 = metrics_now();
+		metric_add(M_REPLAY_BYTES, reply_len);
+		arm_send(slot);
+		conn_timer_arm(&c->timer, send_timeout);
+		return;
+	}
+	size_t ack;
+	if (parse_delta_cmd(c->p.buf, c->p.len, &ack))
+	{
+		// Not stored. Reply straight away with what the client is missing, as far as the file already holds it. The
+		// rest comes with the next reply
+		store_lock();
+		size_t len = written_len();
+		c->is_delta = true;
+		c->sent_off = ack < len ? ack : len;
+		set_reply(c, len);
+		store_unlock();
+		arm_send(slot);
+		conn_timer_arm(&c->timer, send_timeout);
+		return;
+	}
+	queue_append(slot);
+}
+
+static void handle_recv (struct io_uring_cqe *cqe, int slot)
+{
+	struct uconn *c = &u.conns[slot];
+	if (cqe->res == -ENOBUFS)
+	{
+		arm_recv(slot); // every provided buffer is in use. Buffers are recycled as soon as they are parsed
+		return;
+	}
+	if (cqe->res < 0)
+	{
+		close_conn(slot);
+		return;
+	}
+	if (cqe->res == 0)
+	{
+		// Client closed its end, or the drain did. A trailing unterminated packet still counts, commands included, unless
+		// cut short by the drain
+		c->eof = true;
+		if (is_terminated == false && (c->p.len > 0 || keep_alive == false))
+			dispatch_packet(slot);
+		else
+			close_conn(slot);
+		return;
+	}
+	metric_add(M_BYTES_IN, cqe->res);
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		const char *data = u.rbufs + (size_t) bid * RBUF_SIZE;
+		if (c->is_new && data[0] == '\0')
+		{
+			// Records are appended with writev and their payloads outgrow the registered slab: only the threaded engine
+			// takes them
+			aesd_log(LOG_NOTICE, "%s sends records, which need the threaded engine", c->ip_a);
+			recycle_rbuf(bid);
+			close_conn(slot);
+			return;
+		}
+		c->is_new = false;
+		parse_packet(slot, data, cqe->res, false);
+		recycle_rbuf(bid);
+	}
+}
+
+// An append completed. `len` bytes were reserved for it in data_len
+static void handle_write (struct io_uring_cqe *cqe, size_t len)
+{
+	if (cqe->res < (int) len)
+	{
+		aesd_log(LOG_ERR, "Failure to append: %s", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+		store_lock();
+		data_len -= len - (cqe->res < 0 ? 0 : cqe->res); // only what actually landed in the file is visible
+		store_unlock();
+	}
+	u.append_busy = false;
+	start_append();
+}
+
+static void handle_send (struct io_uring_cqe *cqe, int slot)
+{
+	struct uconn *c = &u.conns[slot];
+	if (cqe->res > 0 || (cqe->res == 0 && c->send_len == 0)) // an empty delta or query is a successful reply
+	{
+		c->send_off += cqe->res;
+		metric_add(M_BYTES_OUT, cqe->res);
+		if (c->send_off < c->send_len)
+		{
+			arm_send(slot); // short send. Continue where it stopped
+			conn_timer_arm(&c->timer, send_timeout); // the client is still reading
+			return;
+		}
+		metric_observe(H_REPLAY, c->send_t0);
+		free(c->send_owned);
+		c->send_owned = NULL;
+		if (keep_alive && c->eof == false)
+		{
+			c->p.len = 0; // next packet. Pipelined bytes are parsed before receiving more
+			conn_timer_arm(&c->timer, idle_timeout);
+			if (c->rx_off < c->rx_len)
+				parse_packet(slot, c->rx + c->rx_off, c->rx_len - c->rx_off, true);
+			else
+				arm_recv(slot);
+			return;
+		}
+	}
+	close_conn(slot); // replay done, cancelled by a failed write, or the client went away
+}
+
+static void ring_cleanup (void)
+{
+	for (int i = 0; i < MAX_CONNS; i++)
+	{
+		if (u.conns[i].sock_fd != -1)
+			close_conn(i);
+	}
+	close(u.ring_fd); // also tears down the registered buffers and the provided buffer ring
+	if (u.br != NULL)
+		munmap(u.br, RBUF_COUNT * sizeof(struct io_uring_buf));
+	munmap(u.sqes, u.sqes_sz);
+	munmap(u.ring_ptr, u.ring_sz);
+	free(u.rbufs);
+	free(u.pkts);
+}
+
+static int ring_init (void)
+{
+	struct io_uring_params p;
+	memset(&u, 0, sizeof(u));
+	memset(&p, 0, sizeof(p));
+	for (int i = 0; i < MAX_CONNS; i++)
+	{
+		u.conns[i].sock_fd = -1;
+		u.conns[i].next = i + 1 < MAX_CONNS ? i + 1 : -1;
+	}
+	u.free_head = 0;
+	u.aq_head = u.aq_tail = -1;
+	u.ring_fd = sys_io_uring_setup(RING_ENTRIES, &p);
+	if (u.ring_fd < 0)
+	{
+		aesd_log(LOG_ERR, "Failure to set up io_uring: %s", strerror(errno));
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+	{
+		aesd_log(LOG_ERR, "io_uring is too old for aesdsocket");
+		close(u.ring_fd);
+		return -1;
+	}
+	u.sq_entries = p.sq_entries;
+	size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u.ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+	u.ring_ptr = mmap(NULL, u.ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u.ring_fd, IORING_OFF_SQ_RING);
+	u.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u.sqes = mmap(NULL, u.sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u.ring_fd, IORING_OFF_SQES);
+	if (u.ring_ptr == MAP_FAILED || u.sqes == MAP_FAILED)
+	{
+		aesd_log(LOG_ERR, "Failure to map io_uring: %s", strerror(errno));
+		close(u.ring_fd);
+		return -1;
+	}
+	char *r = (char *) u.ring_ptr;
+	u.sq_head = (unsigned *) (r + p.sq_off.head);
+	u.sq_tail = (unsigned *) (r + p.sq_off.tail);
+	u.sq_mask = (unsigned *) (r + p.sq_off.ring_mask);
+	unsigned *sq_array = (unsigned *) (r + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i; // sqes are always used in ring order, so the indirection array is the identity
+	u.cq_head = (unsigned *) (r + p.cq_off.head);
+	u.cq_tail = (unsigned *) (r + p.cq_off.tail);
+	u.cq_mask = (unsigned *) (r + p.cq_off.ring_mask);
+	u.cqes = (struct io_uring_cqe *) (r + p.cq_off.cqes);
+	u.sq_local_tail = *u.sq_tail;
+
+	// Registered buffers: one slab holding the packet of every connection slot
+	u.pkts = (char *) malloc((size_t) MAX_CONNS * PKT_MAX);
+	u.rbufs = (char *) malloc((size_t) RBUF_COUNT * RBUF_SIZE);
+	struct iovec iov = { .iov_base = u.pkts, .iov_len = (size_t) MAX_CONNS * PKT_MAX };
+	if (u.pkts == NULL || u.rbufs == NULL || sys_io_uring_register(u.ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+	{
+		aesd_log(LOG_ERR, "Failure to register io_uring buffers: %s", strerror(errno));
+		ring_cleanup();
+		return -1;
+	}
+
+	// Provided buffer ring for recv
+	u.br = mmap(NULL, RBUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) u.br;
+	reg.ring_entries = RBUF_COUNT;
+	reg.bgid = RBUF_GROUP;
+	if (u.br == MAP_FAILED || sys_io_uring_register(u.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+	{
+		aesd_log(LOG_ERR, "Failure to register io_uring buffer ring: %s", strerror(errno));
+		if (u.br == MAP_FAILED)
+			u.br = NULL;
+		ring_cleanup();
+		return -1;
+	}
+	for (unsigned short i = 0; i < RBUF_COUNT; i++)
+		recycle_rbuf(i);
+
+	return 0;
+}
+
+int uring_engine_run (void)
+{
+	store_lock();
+	bool mappable = map_data_file(data_len) != NULL;
+	store_unlock();
+	if (mappable == false)
+	{
+		aesd_log(LOG_ERR, "The io_uring engine replays from an mmapped data file only");
+		return -1;
+	}
+	if (ring_init() != 0)
+		return -1;
+	aesd_log(LOG_INFO, "Serving connections from io_uring");
+	u.running = true;
+	if (tfd != -1)
+		arm_timer();
+	arm_signal();
+	if (hfd != -1)
+		arm_handoff();
+
+	bool draining = false;
+	struct timespec now, deadline;
+	while (is_terminated == false || u.live > 0)
+	{
+		if (is_terminated && draining == false)
+		{
+			// Let the connections finish the packets they already received: a connection waiting for a packet sees
+			// the end of its input, while the bytes it already received are still read
+			draining = true;
+			cancel_accept(0);
+			cancel_accept(1);
+			for (int i = 0; i < MAX_CONNS; i++)
+			{
+				if (u.conns[i].sock_fd != -1)
+					shutdown(u.conns[i].sock_fd, SHUT_RD);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += drain_timeout;
+		}
+		if (draining)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now); // checked on every completion, and at least once a second by tfd
+			if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+			{
+				aesd_log(LOG_NOTICE, "%d connections still busy after %u seconds. Closing them", u.live, drain_timeout);
+				break;
+			}
+		}
+		else
+		{
+			if (u.accept_armed[0] == false)
+				arm_accept(0);
+			if (usfd != -1 && u.accept_armed[1] == false)
+				arm_accept(1);
+		}
+		start_append(); // an append that found the SQ full
+		if (ring_submit(true) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			aesd_log(LOG_ERR, "Failure to enter io_uring: %s", strerror(errno));
+			break;
+		}
+		// Reap every completion that is ready before submitting again, so that submissions are batched
+		unsigned head = *u.cq_head;
+		while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+			int slot = UD_SLOT(cqe->user_data);
+			switch (UD_OP(cqe->user_data))
+			{
+			case OP_ACCEPT:
+				handle_accept(cqe, slot);
+				break;
+			case OP_RECV:
+				handle_recv(cqe, slot);
+				break;
+			case OP_WRITE:
+				metric_observe(H_APPEND, u.conns[slot].append_t0);
+				handle_write(cqe, u.conns[slot].p.len);
+				break;
+			case OP_TSWRITE:
+			{
+				size_t len = u.ts_len;
+				u.ts_len = 0; // the record is in the file. Room for the next one
+				handle_write(cqe, len);
+				break;
+			}
+			case OP_TIMER:
+				timers_advance();
+				arm_timer();
+				break;
+			case OP_SEND:
+				handle_send(cqe, slot);
+				break;
+			case OP_SIGNAL:
+				if (cqe->res == sizeof(u.siginfo))
+					is_terminated = true;
+				else
+					arm_signal();
+				break;
+			case OP_HANDOFF:
+				is_handoff = is_terminated = true;
+				break;
+			default:
+				break;
+			}
+			head++;
+			__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+	u.running = false;
+	ring_cleanup();
+	return 0;
+}
+
+bool uring_append_timestamp (const char *rec, size_t len)
+{
+	if (u.running == false)
+		return false;
+	if (len > sizeof(u.ts_rec))
+		len = sizeof(u.ts_rec);
+	if (u.ts_len == 0)
+	{
+		memcpy(u.ts_rec, rec, len); // a record still waiting is simply kept. The next one comes in 10 seconds
+		u.ts_len = len;
+	}
+	start_append();
+	return true;
+}
+
+#endif /* USE_IO_URING */
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE // CPU_SET, pthread_setaffinity_np
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <syslog.h>
 #include <sys/socket.h>
+#include <sys/un.h> // Unix domain listener
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -11,311 +13,1570 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/queue.h> // For the linked list
+#include <stdatomic.h> // connection states and the completion queue
+#include <sys/resource.h> // RLIMIT_NOFILE sizes the connection table
 #include <pthread.h>
 #include <time.h>
+#include <sys/stat.h> // lstat
+#include <sys/timerfd.h> // ticks the timer wheel
+#include <sys/eventfd.h> // wakes main up to reap
+#include <sys/signalfd.h> // termination signals are read by the event loop
+#include <poll.h>
+#include <stdint.h>
+#include <sched.h> // CPU affinity of the listener threads
+#include <stddef.h> // offsetof
+
+#include "aesdsocket.h"
+#include "aesd-timer-wheel.h"
+#include "aesd-log.h"
 
 #define PORT_NUM "9000"
 
+// Default storage backend: /dev/aesdchar for assignment 9. Build with -DUSE_AESD_CHAR_DEVICE=0 to default to the file
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
+#endif
 
-#ifdef USE_AESD_CHAR_DEVICE
-		#define FILE_NAME "/var/tmp/aesdsocketdata"
+#if USE_AESD_CHAR_DEVICE
+		#define STORE_DEFAULT "chardev"
 #else
-		#define FILE_NAME "/dev/aesdchar"
+		#define STORE_DEFAULT "file"
 #endif
 
-// copied SLIST_FOREACH_SAFE from BSD because I need it to remove elements. Glibc does not have this macro
-#define	SLIST_FOREACH_SAFE(var, head, field, tvar)			\
-	for ((var) = SLIST_FIRST((head));				\
-	    (var) && ((tvar) = SLIST_NEXT((var), field), 1);		\
-	    (var) = (tvar))
+#define TIMESTAMP_INTERVAL 10 // seconds between two timestamp records
+
+#define CONN_TABLE_MAX (1 << 16) // upper bound of the connection table, whatever RLIMIT_NOFILE says
+#define LISTENERS_MAX 256
+
+#define OUTQ_IOV_MAX 16 // iovecs gathered into one sendmsg
+
+// A reply waiting to be sent. It points into the data file mapping, or at a copy when the backend cannot be mmapped
+struct out_chunk
+{
+	struct aesd_record hdr; // sent first when the client speaks records
+	size_t hdr_len; // sizeof(hdr) for a record client, 0 otherwise
+	const char *ptr;
+	size_t len;
+	size_t off; // bytes already sent, header included
+	char *owned; // the copy to free once sent. NULL when ptr points into the mapping
+	uint64_t t0; // metrics_now() when it was queued
+};
+
+// Queue of the replies of one connection, bounded by outq_budget. Only its own thread touches it
+struct outq
+{
+	struct out_chunk *chunk; // ring of `slots` chunks, grown as needed
+	size_t slots;
+	size_t head; // index of the oldest chunk
+	size_t count; // chunks queued
+	size_t bytes; // bytes queued and not sent yet
+};
 
-// struct that contains the pthread_t info, socket id, mutex, bool to indicate if the thread is complete, and pointer to itself. This is the node of the linked list
-struct node
+// What to do with a reply that does not fit in the queue of a client that has not read the previous ones
+enum outq_policy
 {
-	pthread_mutex_t ll_m; // mutex for this element
+	OUTQ_DISCONNECT, // close the connection
+	OUTQ_DROP, // discard the new reply
+	OUTQ_SKIP, // discard the replies that were not started yet and queue the new one
+};
+
+enum conn_state
+{
+	CONN_FREE, // slot unused
+	CONN_ACTIVE, // a thread serves the connection
+	CONN_DONE, // the thread finished and sits on the completion queue, waiting to be joined
+};
+
+// A connection and the thread serving it. Connections live in a table indexed by their socket fd: the socket is only
+// closed once the thread has been joined and the slot freed, so accept cannot reuse the fd while the slot is taken
+struct conn
+{
+	_Atomic int state; // enum conn_state
 	pthread_t t_id; // thread id of this particular thread
-	char ip_a[INET_ADDRSTRLEN]; // store the IPv4 addr of the connected client in string representation
+	char ip_a[PEER_ADDRSTRLEN]; // store the addr of the connected client in string representation
 	int sock_fd; // client socket file descriptor
-	bool is_completed; // true when the thread is ready to be terminated
-	SLIST_ENTRY(node) next; // macro for the next element in the linked list
+	bool is_delta; // replies only carry what was appended since the previous reply
+	bool is_binary; // the client speaks records rather than lines
+	uint64_t seq; // seq of the last record received, echoed in the replies
+	size_t sent_off; // offset of the store up to which this client has been sent data
+	struct aesd_timer timer; // idle / slow client deadline
+	struct outq outq; // replies waiting for the socket to become writable
+	struct conn *done_next; // link of the completion queue
 };
 
-SLIST_HEAD(slisthead, node); // head of the singly linked list
-struct slisthead head;
+struct conn *conn_table; // indexed by socket fd
+size_t conn_table_len;
+// Completion queue: a lock-free stack that finished threads push themselves onto. The main thread takes the whole
+// stack at once, so reaping costs O(finished connections) and never looks at the live ones
+_Atomic(struct conn *) done_head = NULL;
+int reap_efd = -1; // written when the completion queue stops being empty
+_Atomic size_t conns_active = 0; // connections accepted and not reaped yet
 
 int sfd; // server socket. global for signal handler to close
-int fd;
-pthread_mutex_t fd_m; // mutex for FILE_NAME fd
+int usfd = -1; // Unix domain server socket. -1 when there is none
+int sigfd = -1; // signalfd of SIGINT and SIGTERM
+int hfd = -1; // handoff socket (-H). -1 when there is none
+int stop_efd = -1; // written once is_terminated is set, to wake the listener threads up
+pthread_mutex_t fd_m; // mutex for the storage backend
+size_t data_len; // committed length of the stream of appends. Protected by fd_m
+const struct store_ops *store;
+
+// A listening socket of its own and the thread accepting on it, pinned to one core. The kernel spreads incoming
+// connections across the SO_REUSEPORT sockets, and the connection threads inherit the affinity of the listener that
+// created them, so a client is served on the core that accepted it
+struct listener
+{
+	pthread_t t_id;
+	int sock_fd;
+	int cpu;
+};
 
 void *thread_func (void *); // declaration of the func that the thread will run
 
-bool is_terminated = false; // variable for main loop
+atomic_bool is_terminated = false; // variable for main loop, read by the connection and listener threads
+bool is_handoff = false; // a new process asked for the listening sockets
+bool keep_alive = false; // -k: serve many newline delimited packets per connection
+unsigned idle_timeout = 0; // -t: seconds a connection may wait for its next packet. 0 to disable
+unsigned send_timeout = 0; // -w: seconds a client may stall reading its replies before it is evicted. 0 to disable
+size_t outq_budget = SIZE_MAX; // -q: bytes of replies a client may have queued behind the one being sent
+enum outq_policy outq_policy = OUTQ_DISCONNECT; // -Q: what happens to a client over its budget
+const char *bind_address = NULL; // -a: address to bind. NULL for every address of both families
+const char *bind_port = PORT_NUM; // -p
+const char *unix_path = NULL; // -U: path of the Unix domain listener. NULL for none
+int listen_backlog = SOMAXCONN; // -b: backlog of each listening socket
+long listener_count = 1; // -l: listening sockets, one thread each. 0 for one per online core
+int log_level = LOG_DEBUG; // -L: least severe level logged
+unsigned log_rate = 0; // -R: log records per second. 0 for no limit
+const char *metrics_where = NULL; // -M: port of 127.0.0.1 or Unix socket path serving the metrics. NULL for none
+unsigned drain_timeout = 5; // -g: seconds the connections have to finish their work once terminated
+const char *handoff_path = NULL; // -H: Unix socket path through which the listening sockets are handed over
+const char *pidfile = NULL; // -P: file the pid of the server is written to once it is ready. NULL for none
+int ready_pipe = -1; // -d: the foreground process waits for a byte on this pipe before it exits
+struct timespec start_time; // when main started, to measure the startup
 
-#ifndef USE_AESD_CHAR_DEVICE
-static void add_timestamp (union sigval sv)
+// Timekeeping runs on the event loop: a timerfd ticks once per second and advances a hierarchical timer wheel holding
+// the timestamp timer and every connection deadline
+int tfd = -1;
+struct aesd_timer_wheel wheel; // protected by wheel_m. Lock order: fd_m, then wheel_m
+pthread_mutex_t wheel_m;
+struct aesd_timer timestamp_timer; // only armed when the backend takes timestamps
+bool timestamp_due = false; // set under wheel_m, the record is written once wheel_m is released
+
+static uint64_t wheel_tick_now (void)
 {
-	time_t t;
-	ssize_t write_ret_val;
-	struct tm *tmp;
-	char buf[100];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
 
-	t = time(NULL);
-	tmp = localtime(&t);
-	strftime(buf, 100, "%a, %d %b %Y %T %z", tmp);
-	pthread_mutex_lock(&fd_m);
-	write_ret_val = write(fd, "timestamp:", 10);
-	write_ret_val = write(fd, buf, strlen(buf));
-	write_ret_val = write(fd, "\n", 1);
-	(void) write_ret_val; // Explicitly ignore returned value to get rid of the "-Werror=unused-result" error
-	pthread_mutex_unlock(&fd_m);
+// Format the wall clock for the timestamp records. localtime_r/strftime only run when the second changed. Called from
+// the event loop only
+static const char *timestamp_str (time_t t)
+{
+	static time_t cached_t = -1;
+	static char cached[100];
+	if (t != cached_t)
+	{
+		struct tm tm;
+		localtime_r(&t, &tm);
+		strftime(cached, sizeof(cached), "%a, %d %b %Y %T %z", &tm);
+		cached_t = t;
+	}
+	return cached;
 }
+
+static void add_timestamp (void)
+{
+	char buf[128];
+	ssize_t write_ret_val;
+	int len = snprintf(buf, sizeof(buf), "timestamp:%s\n", timestamp_str(time(NULL)));
+#ifdef USE_IO_URING
+	if (uring_append_timestamp(buf, len))
+		return; // the ring engine orders it with the packets it appends
 #endif
+	store_lock();
+	write_ret_val = store->append(buf, len); // one append keeps the record in one piece
+	if (write_ret_val > 0)
+		data_len += write_ret_val;
+	store_unlock();
+}
+
+static void timestamp_timer_fn (struct aesd_timer *t)
+{
+	timestamp_due = true;
+	aesd_timer_add(&wheel, t, t->expires + TIMESTAMP_INTERVAL);
+}
+
+// A connection missed its deadline. Shut its socket down so that whatever blocks on it fails and the connection is
+// torn down by its owner. The socket is still open: owners disarm the timer before closing it
+static void evict_conn (struct aesd_timer *t)
+{
+	int sock = (int) (intptr_t) t->data;
+	aesd_log(LOG_INFO, "Evicting idle or slow client on socket %d", sock);
+	shutdown(sock, SHUT_RDWR);
+}
+
+void conn_timer_init (struct aesd_timer *t, int sock)
+{
+	memset(t, 0, sizeof(*t));
+	t->fn = evict_conn;
+	t->data = (void *) (intptr_t) sock;
+}
+
+void conn_timer_arm (struct aesd_timer *t, unsigned secs)
+{
+	if (secs == 0 && aesd_timer_pending(t) == false)
+		return; // deadline disabled
+	pthread_mutex_lock(&wheel_m);
+	aesd_timer_del(t);
+	if (secs != 0)
+		aesd_timer_add(&wheel, t, wheel_tick_now() + secs + 1); // +1: the current second is already partly gone
+	pthread_mutex_unlock(&wheel_m);
+}
+
+void conn_timer_disarm (struct aesd_timer *t)
+{
+	conn_timer_arm(t, 0);
+}
+
+void timers_advance (void)
+{
+	pthread_mutex_lock(&wheel_m);
+	aesd_timer_wheel_advance(&wheel, wheel_tick_now());
+	pthread_mutex_unlock(&wheel_m);
+	if (timestamp_due)
+	{
+		timestamp_due = false;
+		add_timestamp();
+	}
+}
+
+static void outq_pop (struct outq *q)
+{
+	struct out_chunk *ch = &q->chunk[q->head];
+	q->bytes -= ch->hdr_len + ch->len - ch->off;
+	free(ch->owned);
+	q->head = (q->head + 1) % q->slots;
+	q->count--;
+}
+
+// Drop every queued reply, except the one being sent if `keep_started`. A half sent reply is not cut short
+static void outq_clear (struct outq *q, bool keep_started)
+{
+	size_t keep = (keep_started && q->count > 0 && q->chunk[q->head].off > 0) ? 1 : 0;
+	while (q->count > keep)
+	{
+		size_t last = (q->head + q->count - 1) % q->slots;
+		struct out_chunk *ch = &q->chunk[last];
+		q->bytes -= ch->hdr_len + ch->len - ch->off;
+		free(ch->owned);
+		q->count--;
+	}
+}
+
+// Queue a reply, applying `policy` when the client has not read its previous replies and the reply would take it
+// over outq_budget. A reply to a record client is framed by `hdr`, NULL otherwise. Takes ownership of `owned`. Sets
+// *dropped when the reply was discarded. Returns false when the client has to be disconnected
+static bool outq_push (struct outq *q, enum outq_policy policy, const struct aesd_record *hdr, const char *ptr,
+	size_t len, char *owned, bool *dropped)
+{
+	size_t hdr_len = hdr != NULL ? sizeof(*hdr) : 0;
+	*dropped = false;
+	if (q->count > 0 && q->bytes + hdr_len + len > outq_budget)
+	{
+		switch (policy)
+		{
+		case OUTQ_DROP:
+			free(owned);
+			*dropped = true;
+			return true;
+		case OUTQ_SKIP:
+			outq_clear(q, true);
+			break;
+		default:
+			free(owned);
+			return false;
+		}
+	}
+	if (q->count == q->slots)
+	{
+		// Grow the ring, unwrapping it at the same time
+		size_t slots = q->slots == 0 ? 4 : q->slots * 2;
+		struct out_chunk *chunk = (struct out_chunk *) malloc(slots * sizeof(struct out_chunk));
+		if (chunk == NULL)
+		{
+			free(owned);
+			return false;
+		}
+		for (size_t i = 0; i < q->count; i++)
+			chunk[i] = q->chunk[(q->head + i) % q->slots];
+		free(q->chunk);
+		q->chunk = chunk;
+		q->slots = slots;
+		q->head = 0;
+	}
+	struct out_chunk *ch = &q->chunk[(q->head + q->count) % q->slots];
+	if (hdr != NULL)
+		ch->hdr = *hdr;
+	ch->hdr_len = hdr_len;
+	ch->ptr = ptr;
+	ch->len = len;
+	ch->off = 0;
+	ch->owned = owned;
+	ch->t0 = metrics_now();
+	q->count++;
+	q->bytes += hdr_len + len;
+	return true;
+}
+
+// Add the unsent part of `ch` to `iov`. Returns the number of iovecs used, at most 2
+static int out_chunk_iov (struct out_chunk *ch, struct iovec *iov)
+{
+	int cnt = 0;
+	if (ch->off < ch->hdr_len)
+		iov[cnt++] = (struct iovec) { .iov_base = (char *) &ch->hdr + ch->off, .iov_len = ch->hdr_len - ch->off };
+	size_t body_off = ch->off > ch->hdr_len ? ch->off - ch->hdr_len : 0;
+	if (body_off < ch->len)
+		iov[cnt++] = (struct iovec) { .iov_base = (char *) ch->ptr + body_off, .iov_len = ch->len - body_off };
+	return cnt;
+}
+
+// Send as much of the queue as the socket takes without blocking. Returns false if the client went away. *progress
+// is set when anything was sent
+static bool outq_flush (struct outq *q, int sock, bool *progress)
+{
+	while (q->count > 0)
+	{
+		// Gather the queued replies, and the header of each for a record client, into one sendmsg. They go straight from
+		// the page cache. MSG_NOSIGNAL: a closed client must not SIGPIPE the server
+		struct iovec iov[OUTQ_IOV_MAX];
+		int cnt = 0;
+		for (size_t i = 0; i < q->count && cnt + 2 <= OUTQ_IOV_MAX; i++)
+			cnt += out_chunk_iov(&q->chunk[(q->head + i) % q->slots], iov + cnt);
+		size_t sent = 0;
+		if (cnt > 0)
+		{
+			struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+			ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return true; // socket buffer full. Wait for POLLOUT
+			if (n <= 0)
+				return false;
+			sent = n;
+			*progress = true;
+			metric_add(M_BYTES_OUT, n);
+		}
+		// Retire the replies sent in full, empty ones included
+		while (q->count > 0)
+		{
+			struct out_chunk *ch = &q->chunk[q->head];
+			size_t rest = ch->hdr_len + ch->len - ch->off;
+			size_t take = rest < sent ? rest : sent;
+			ch->off += take;
+			q->bytes -= take;
+			sent -= take;
+			if (take < rest)
+				break;
+			metric_observe(H_REPLAY, ch->t0);
+			outq_pop(q);
+		}
+	}
+	return true;
+}
+
+bool parse_delta_cmd (const char *pkt, size_t len, size_t *offset)
+{
+	const size_t cmd_len = sizeof(DELTA_CMD) - 1;
+	if (len <= cmd_len || memcmp(pkt, DELTA_CMD, cmd_len) != 0)
+		return false;
+	char num[32]; // the packet is not null terminated
+	size_t n = len - cmd_len < sizeof(num) ? len - cmd_len : sizeof(num) - 1;
+	memcpy(num, pkt + cmd_len, n);
+	num[n] = '\0';
+	char *end;
+	errno = 0;
+	unsigned long long off = strtoull(num, &end, 10);
+	if (end == num || errno != 0 || (*end != '\n' && *end != '\0'))
+		return false; // malformed commands are stored like any other packet
+	*offset = off;
+	return true;
+}
+
+size_t pkt_parse (struct pkt_parser *p, const char *data, size_t n, bool *complete)
+{
+	const char *nl = memchr(data, '\n', n);
+	size_t take = nl == NULL ? n : (size_t) (nl - data) + 1; // bytes up to and including the end of the packet
+	*complete = false;
+	if (p->discarding)
+	{
+		p->discarding = (nl == NULL); // skip the tail of an over-length packet
+		return take;
+	}
+	if (p->len + take >= PKT_MAX && (nl == NULL || p->len + take > PKT_MAX))
+	{
+		// Over-length: keep the first PKT_MAX bytes and skip the rest of the line
+		take = PKT_MAX - p->len;
+		memcpy(p->buf + p->len, data, take);
+		p->len = PKT_MAX;
+		p->discarding = true;
+		*complete = true;
+		return take;
+	}
+	memcpy(p->buf + p->len, data, take);
+	p->len += take;
+	*complete = (nl != NULL);
+	return take;
+}
+
+static uint64_t realtime_ns (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Queue a reply. A record client gets it as one record, carrying the seq of the record it answers. `from` is the
+// offset of the store at which a delta mode replay starts, SIZE_MAX for any other reply. A delta replay is never
+// skipped, since the client would not know about the gap: it is dropped instead, and sent_off goes back to its start
+// so that the next reply carries it
+static bool reply_push (struct conn *n, const char *ptr, size_t len, char *owned, size_t from)
+{
+	enum outq_policy policy = (from != SIZE_MAX && outq_policy == OUTQ_SKIP) ? OUTQ_DROP : outq_policy;
+	struct aesd_record hdr;
+	if (n->is_binary)
+	{
+		if (len > UINT32_MAX)
+		{
+			ptr += len - UINT32_MAX; // a history over 4 GiB is replied its last 4 GiB
+			len = UINT32_MAX;
+		}
+		hdr = (struct aesd_record) { .magic = htole32(AESD_RECORD_MAGIC), .len = htole32(len),
+			.seq = htole64(n->seq), .timestamp_ns = htole64(realtime_ns()) };
+	}
+	bool dropped;
+	if (outq_push(&n->outq, policy, n->is_binary ? &hdr : NULL, ptr, len, owned, &dropped) == false)
+		return false;
+	if (dropped && from != SIZE_MAX)
+		n->sent_off = from;
+	return true;
+}
+
+// Queue the reply to a GREP_CMD or TAIL_CMD. The history is snapshotted under fd_m and scanned without it
+static bool handle_query (struct conn *n, const struct query *q)
+{
+	size_t copy_len = 0;
+	store_lock();
+	size_t len = data_len;
+	const char *base = map_data_file(len);
+	char *copy = base == NULL ? store->copy(0, len, &copy_len) : NULL;
+	store_unlock();
+	if (base == NULL && copy == NULL)
+		return false; // out of memory
+	size_t reply_len;
+	char *owned;
+	const char *reply = query_run(q, base != NULL ? base : copy, base != NULL ? len : copy_len, &reply_len, &owned);
+	if (reply == NULL)
+	{
+		free(copy);
+		return false;
+	}
+	if (owned != NULL)
+	{
+		free(copy); // the lines were copied out of it
+		copy = owned;
+	}
+	metric_add(M_REPLAY_BYTES, reply_len);
+	return reply_push(n, reply, reply_len, copy, SIZE_MAX);
+}
+
+// Append a packet to the store and queue the FULL content of the store as the reply to the client, or in delta mode
+// only what was appended since the last reply to this client. A DELTA_CMD packet switches to delta mode and is not
+// stored, nor are queries. fd_m is only held to append and to snapshot the reply, never while talking to the client. Returns false
+// when the client has to be disconnected. `rec` is the header of the record that carried the packet, NULL for a line
+static bool handle_packet (struct conn *n, const struct aesd_record *rec, const char *pkt, size_t len)
+{
+	struct query q;
+	if (len <= PKT_MAX && parse_query_cmd(pkt, len, &q))
+		return handle_query(n, &q);
+	size_t ack;
+	bool is_cmd = parse_delta_cmd(pkt, len, &ack);
+	uint64_t t0 = metrics_now();
+	store_lock();
+	if (is_cmd)
+	{
+		n->is_delta = true;
+		n->sent_off = ack < data_len ? ack : data_len; // the client already holds everything before `ack`
+	}
+	else
+	{
+		ssize_t write_ret_val; // ignore failure to write
+		if (rec != NULL)
+		{
+			// The record as it came, header and payload in one call
+			struct iovec iov[2] = { { .iov_base = (void *) rec, .iov_len = sizeof(*rec) },
+				{ .iov_base = (void *) pkt, .iov_len = len } };
+			write_ret_val = store->appendv(iov, 2);
+		}
+		else
+			write_ret_val = store->append(pkt, len);
+		if (write_ret_val > 0)
+			data_len += write_ret_val; // only what actually landed in the store is visible to readers
+		metric_add(M_PACKETS, 1);
+		metric_observe(H_APPEND, t0);
+	}
+	size_t from = n->is_delta ? n->sent_off : 0;
+	size_t to = data_len;
+	size_t copy_len = 0;
+	const char *base = map_data_file(to); // mapped windows stay valid until exit, so the reply can be sent unlocked
+	char *copy = base == NULL ? store->copy(from, to, &copy_len) : NULL;
+	n->sent_off = to;
+	store_unlock();
+	if (base == NULL && copy == NULL)
+		return false; // out of memory
+	metric_add(M_REPLAY_BYTES, base != NULL ? to - from : copy_len);
+	return reply_push(n, base != NULL ? base + from : copy, base != NULL ? to - from : copy_len, copy,
+		n->is_delta ? from : SIZE_MAX);
+}
+
+// A record being received from a record client
+struct record_rx
+{
+	struct aesd_record hdr;
+	size_t hdr_got; // bytes of hdr received
+	char *payload; // malloc'd once hdr is complete, NULL until then
+	size_t len; // payload length, from hdr
+	size_t got; // bytes of payload received
+};
+
+// Copy received bytes into the header, then into the payload of the record being received. Nothing is scanned: the
+// header gives the length. Returns the number of bytes consumed, or -1 when the client sent a bad header or the
+// payload cannot be allocated. *complete is set once the record is whole
+static ssize_t record_feed (struct conn *n, struct record_rx *r, const char *data, size_t len, bool *complete)
+{
+	size_t used = 0;
+	if (r->payload == NULL)
+	{
+		used = sizeof(r->hdr) - r->hdr_got < len ? sizeof(r->hdr) - r->hdr_got : len;
+		memcpy((char *) &r->hdr + r->hdr_got, data, used);
+		r->hdr_got += used;
+		if (r->hdr_got < sizeof(r->hdr))
+			return used;
+		r->len = le32toh(r->hdr.len);
+		if (le32toh(r->hdr.magic) != AESD_RECORD_MAGIC || r->len > RECORD_MAX)
+		{
+			aesd_log(LOG_NOTICE, "Bad record header from %s", n->ip_a);
+			return -1;
+		}
+		r->payload = (char *) malloc(r->len + 1); // +1 so that an empty payload is not mistaken for a failure
+		if (r->payload == NULL)
+			return -1;
+		r->got = 0;
+	}
+	size_t take = r->len - r->got < len - used ? r->len - r->got : len - used;
+	memcpy(r->payload + r->got, data + used, take);
+	r->got += take;
+	*complete = r->got == r->len;
+	return used + take;
+}
+
+// Handle the complete record of `r` and get ready for the next one
+static bool record_done (struct conn *n, struct record_rx *r)
+{
+	n->seq = le64toh(r->hdr.seq);
+	if (r->hdr.timestamp_ns == 0)
+		r->hdr.timestamp_ns = htole64(realtime_ns()); // stamped on arrival
+	bool ok = handle_packet(n, &r->hdr, r->payload, r->len);
+	free(r->payload);
+	r->payload = NULL;
+	r->hdr_got = 0;
+	return ok;
+}
 
 // Func registered to run when pthread_cancel is called, and when the thread terminates
 static void thread_cleanup (void *arg)
 {
-	struct node *n = (struct node *) arg; // to shut the compiler up about incompatible arg type
-	close(n->sock_fd);
-	n->is_completed = true;
-	n->sock_fd = -1;
-	pthread_mutex_unlock(&n->ll_m);
+	struct conn *n = (struct conn *) arg; // to shut the compiler up about incompatible arg type
+	conn_timer_disarm(&n->timer);
+	metric_add(M_CLOSED, 1);
+	outq_clear(&n->outq, false);
+	free(n->outq.chunk);
+	n->outq.chunk = NULL;
+	shutdown(n->sock_fd, SHUT_RDWR); // the client sees the end of the connection now, not once it is reaped
+	// Hand the connection over to the main thread, which joins this thread and closes the socket
+	atomic_store(&n->state, CONN_DONE);
+	n->done_next = atomic_load(&done_head);
+	while (atomic_compare_exchange_weak(&done_head, &n->done_next, n) == false)
+		; // done_next was reloaded by the failed exchange
+	if (n->done_next == NULL)
+	{
+		uint64_t one = 1;
+		ssize_t ret = write(reap_efd, &one, sizeof(one)); // the queue was empty: main may be asleep
+		(void) ret;
+	}
 }
 
-void term_sig_handl (int signum)
+// Join every finished connection thread and release its slot
+static void reap_conns (void)
 {
-	// Is this handler reentrant? Is it signal safe?
-	close(fd); // close FILE_NAME. signal safe
-	close(sfd); // close the server socket to unblock `accept` in `main`. signal safe
-#ifndef USE_AESD_CHAR_DEVICE
-	unlink(FILE_NAME); // delete the file. signal safe
-#endif
-	struct node *n_tmp = NULL;
-	struct node *n_tmp_2 = NULL; // n_tmp_2 is purely for SLIST_FOREACH_SAFE
-	SLIST_FOREACH_SAFE(n_tmp, &head, next, n_tmp_2) // to close the fds of all threads
-		close(n_tmp->sock_fd); // to make all recv unblock with error. signal safe
-	is_terminated = true; // terminate main while loop
+	struct conn *n = atomic_exchange(&done_head, NULL);
+	while (n != NULL)
+	{
+		struct conn *next = n->done_next;
+		pthread_join(n->t_id, NULL); // join thread. It already ran thread_cleanup, so this does not block for long
+		int sock = n->sock_fd;
+		// Free the slot before its fd can be handed out again: another listener may accept that fd as soon as it is closed
+		atomic_store_explicit(&n->state, CONN_FREE, memory_order_release);
+		close(sock);
+		atomic_fetch_sub(&conns_active, 1);
+		n = next;
+	}
 }
 
-int main (int argc, char **argv)
+void peer_name (const struct sockaddr_storage *ss, char *buf)
 {
-	struct sockaddr_in inc_sock; // information of incoming connecting socket
-	struct addrinfo *skaddr_ptr; // initialized by getaddrinfo
+	const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) ss;
+	const char *ok = NULL;
+	if (ss->ss_family == AF_INET)
+		ok = inet_ntop(AF_INET, &((const struct sockaddr_in *) ss)->sin_addr, buf, PEER_ADDRSTRLEN);
+	else if (ss->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+		ok = inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], buf, PEER_ADDRSTRLEN); // IPv4 client of the dual-stack socket
+	else if (ss->ss_family == AF_INET6)
+		ok = inet_ntop(AF_INET6, &in6->sin6_addr, buf, PEER_ADDRSTRLEN);
+	else if (ss->ss_family == AF_UNIX)
+		ok = strcpy(buf, "local");
+	if (ok == NULL)
+		strcpy(buf, "?");
+}
 
+// Accept a connection on `lfd` and start the thread serving it
+static void accept_conn (int lfd)
+{
+	struct sockaddr_storage inc_sock; // information of incoming connecting socket
+	socklen_t inc_sock_size = sizeof(inc_sock);
+	int cfd = accept(lfd, (struct sockaddr *)&inc_sock, &inc_sock_size);
+	if (cfd < 0)
+	{
+		// Error connecting
+		aesd_log(LOG_ERR, "Failure to accept connection: %s", strerror(errno));
+		return;
+	}
+	if ((size_t) cfd >= conn_table_len || atomic_load(&conn_table[cfd].state) != CONN_FREE)
+	{
+		aesd_log(LOG_ERR, "No connection slot for fd %d", cfd);
+		close(cfd);
+		return;
+	}
+	struct conn *n_new = &conn_table[cfd]; // O(1)
+	n_new->is_delta = false;
+	n_new->is_binary = false;
+	n_new->seq = 0;
+	n_new->sent_off = 0;
+	memset(&n_new->outq, 0, sizeof(n_new->outq));
+	conn_timer_init(&n_new->timer, cfd);
+	n_new->sock_fd = cfd;
+	peer_name(&inc_sock, n_new->ip_a);
+	aesd_log_conn(AESD_LOG_ACCEPT, cfd, n_new->ip_a);
+	atomic_store(&n_new->state, CONN_ACTIVE);
+	atomic_fetch_add(&conns_active, 1); // before the thread exists, so that its reaping never takes the count below 0
+	if (pthread_create(&n_new->t_id, NULL, thread_func, (void *) n_new) != 0) // New default thread for the new connection
+	{
+		aesd_log(LOG_ERR, "Failure to create a thread: %s", strerror(errno));
+		atomic_fetch_sub(&conns_active, 1);
+		atomic_store(&n_new->state, CONN_FREE);
+		close(cfd);
+		return;
+	}
+	metric_add(M_ACCEPTED, 1);
+}
 
-	int ret = 0; // placeholder for function return values
-	openlog("aesdsocket", LOG_PID, LOG_USER); // Initialize syslog
-	signal(SIGTERM, term_sig_handl);
-	signal(SIGINT, term_sig_handl);
+// Open a listening socket bound to `ai`. SO_REUSEPORT lets several of them share the address
+static int open_listener (const struct addrinfo *ai, bool reuse_port)
+{
+	int lfd = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (lfd == -1)
+		return -1;
+	const int enable = 1;
+	const int disable = 0;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)); // SO_REUSEADDR to get rid of bind error
+	if (ai->ai_family == AF_INET6)
+		setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int)); // IPv4 clients too, whatever the sysctl says
+	if ((reuse_port && setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == -1)
+		|| bind(lfd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(lfd, listen_backlog) == -1)
+	{
+		int err = errno;
+		close(lfd);
+		errno = err;
+		return -1;
+	}
+	return lfd;
+}
 
-	SLIST_INIT(&head); // Initialize the head of the linked list
+// Open the listening sockets on bind_address:bind_port. Without an address one IPv6 socket per listener takes clients
+// of both families, or IPv4 alone on hosts without IPv6
+static int open_listeners (struct listener *listeners)
+{
+	int families[2] = { bind_address == NULL ? AF_INET6 : AF_UNSPEC, AF_INET };
+	for (int f = 0; f < (bind_address == NULL ? 2 : 1); f++)
+	{
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = families[f];
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		struct addrinfo *skaddr_ptr; // initialized by getaddrinfo
+		int ret = getaddrinfo(bind_address, bind_port, &hints, &skaddr_ptr);
+		if (ret != 0)
+		{
+			aesd_log(LOG_ERR, "Failure to getaddrinfo: %s", gai_strerror(ret));
+			continue;
+		}
+		for (struct addrinfo *ai = skaddr_ptr; ai != NULL; ai = ai->ai_next)
+		{
+			long i = 0;
+			while (i < listener_count && (listeners[i].sock_fd = open_listener(ai, listener_count > 1)) != -1)
+				i++;
+			if (i == listener_count)
+			{
+				freeaddrinfo(skaddr_ptr);
+				return 0;
+			}
+			aesd_log(LOG_ERR, "Failure to set up the listening socket: %s", strerror(errno));
+			while (i-- > 0)
+				close(listeners[i].sock_fd);
+		}
+		freeaddrinfo(skaddr_ptr);
+	}
+	return -1;
+}
 
-	// Open a stream socket bound to port 9000. Return -1 if any connection steps fail
-	sfd = socket(AF_INET, SOCK_STREAM, 0);
-	const int enable = 1;
-	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)); // SO_REUSEADDR to get rid of bind error
-	// TODO: what if setsockopt fails?
-	if (sfd == -1)
+// Open a Unix domain listening socket at `path`, replacing the socket a previous run left behind
+static int open_unix_listener (const char *path)
+{
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
 	{
-		syslog(LOG_USER | LOG_ERR, "Failure to initialize socket");
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd == -1)
+		return -1;
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path); // never a file that is not a socket
+	if (bind(lfd, (struct sockaddr *) &sun, sizeof(sun)) == -1 || listen(lfd, listen_backlog) == -1)
+	{
+		int err = errno;
+		close(lfd);
+		errno = err;
+		return -1;
+	}
+	return lfd;
+}
+
+static void set_store (const char *name)
+{
+	store = store_find(name);
+	if (store == NULL)
+	{
+		aesd_log(LOG_ERR, "Unknown store %s. Expected file, chardev, ring or ring-lz4", name);
 		exit(-1);
 	}
+}
 
-	ret = getaddrinfo("0.0.0.0", PORT_NUM, NULL, &skaddr_ptr);
-	if (ret != 0)
+// A syslog level, by name (err, warning, notice, info, debug) or number
+static int parse_log_level (const char *name)
+{
+	static const char *names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++)
 	{
-		freeaddrinfo(skaddr_ptr);
-		syslog(LOG_USER | LOG_ERR, "Failure to getaddrinfo: %s", gai_strerror(ret));
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	}
+	return atoi(name);
+}
+
+// Read "key value" lines of a config file into the settings. Keys are named after the long form of the options
+static void load_config (const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	{
+		aesd_log(LOG_ERR, "Failure to open config file %s: %s", path, strerror(errno));
 		exit(-1);
 	}
+	char line[512];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		lineno++;
+		char key[64];
+		char value[sizeof(line)];
+		char *hash = strchr(line, '#');
+		if (hash != NULL)
+			*hash = '\0'; // comment
+		int n = sscanf(line, " %63[^= \t]%*[= \t]%511s", key, value);
+		if (n <= 0)
+			continue; // blank line
+		if (n != 2)
+			aesd_log(LOG_ERR, "%s:%d: missing value", path, lineno);
+		else if (strcmp(key, "address") == 0)
+			bind_address = strdup(value);
+		else if (strcmp(key, "port") == 0)
+			bind_port = strdup(value);
+		else if (strcmp(key, "backlog") == 0)
+			listen_backlog = atoi(value);
+		else if (strcmp(key, "listeners") == 0)
+			listener_count = strtol(value, NULL, 10);
+		else if (strcmp(key, "unix") == 0)
+			unix_path = strdup(value);
+		else if (strcmp(key, "store") == 0)
+			set_store(value);
+		else if (strcmp(key, "log_level") == 0)
+			log_level = parse_log_level(value);
+		else if (strcmp(key, "log_rate") == 0)
+			log_rate = strtoul(value, NULL, 10);
+		else if (strcmp(key, "metrics") == 0)
+			metrics_where = strdup(value);
+		else if (strcmp(key, "drain_timeout") == 0)
+			drain_timeout = strtoul(value, NULL, 10);
+		else if (strcmp(key, "handoff") == 0)
+			handoff_path = strdup(value);
+		else if (strcmp(key, "pidfile") == 0)
+			pidfile = strdup(value);
+		else
+			aesd_log(LOG_ERR, "%s:%d: unknown key %s", path, lineno, key);
+	}
+	fclose(f);
+}
+
+static void pin_to_cpu (pthread_t t, int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(t, sizeof(set), &set) != 0)
+		aesd_log(LOG_ERR, "Failure to pin a listener to CPU %d", cpu);
+}
 
-	ret = bind(sfd, skaddr_ptr->ai_addr, sizeof(struct sockaddr));
-	if (ret == -1)
+// Accept loop of the additional listeners. main shuts the socket down to wake it up once is_terminated is set
+static void *listener_func (void *arg)
+{
+	struct listener *l = (struct listener *) arg;
+	pin_to_cpu(pthread_self(), l->cpu); // before any connection thread is created, so that they inherit it
+	struct pollfd pfds[2] = { { .fd = l->sock_fd, .events = POLLIN }, { .fd = stop_efd, .events = POLLIN } };
+	while (is_terminated == false)
 	{
-		freeaddrinfo(skaddr_ptr);
-		syslog(LOG_USER | LOG_ERR, "Failure to bind socket");
+		if (poll(pfds, 2, -1) == -1)
+			continue;
+		reap_conns();
+		if (is_terminated == false && (pfds[0].revents & POLLIN))
+			accept_conn(l->sock_fd);
+	}
+	return NULL;
+}
+
+// A termination signal is pending on sigfd
+static void handle_sigfd (void)
+{
+	struct signalfd_siginfo si;
+	if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+		is_terminated = true; // main then drains the connections
+}
+
+// Let the connections finish the packets they already received and send their replies, for up to drain_timeout
+// seconds. Shutting the read side down makes a connection waiting for a packet see the end of its input, while the
+// bytes it already received are still read. Whatever is left at the deadline is shut down for good
+static void drain_conns (void)
+{
+	for (size_t i = 0; i < conn_table_len; i++)
+	{
+		if (atomic_load(&conn_table[i].state) == CONN_ACTIVE)
+			shutdown(conn_table[i].sock_fd, SHUT_RD);
+	}
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += drain_timeout;
+	struct pollfd pfd = { .fd = reap_efd, .events = POLLIN };
+	reap_conns();
+	while (atomic_load(&conns_active) > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			break;
+		if (poll(&pfd, 1, ms) == 1)
+		{
+			uint64_t completions;
+			ssize_t ret = read(reap_efd, &completions, sizeof(completions));
+			(void) ret;
+		}
+		reap_conns();
+	}
+	if (atomic_load(&conns_active) > 0)
+		aesd_log(LOG_NOTICE, "%zu connections still busy after %u seconds. Closing them", atomic_load(&conns_active),
+			drain_timeout);
+	// Shut every live connection down so that its thread wakes up and finishes, then join them all
+	for (size_t i = 0; i < conn_table_len; i++)
+	{
+		if (atomic_load(&conn_table[i].state) == CONN_ACTIVE)
+			shutdown(conn_table[i].sock_fd, SHUT_RDWR);
+	}
+	for (size_t i = 0; i < conn_table_len; i++)
+	{
+		while (atomic_load(&conn_table[i].state) == CONN_ACTIVE)
+			usleep(1000); // not on the completion queue yet
+		reap_conns();
+	}
+}
+
+// Hot restart. The handoff carries one listening socket per message, tagged with its kind
+#define HANDOFF_LISTENER 'L'
+#define HANDOFF_UNIX 'U'
+
+static int send_fd (int sock, char kind, int pass_fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct iovec iov = { .iov_base = &kind, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Receive one socket. Returns its kind, or 0 at the end of the handoff
+static char recv_fd (int sock, int *fd_rtn)
+{
+	char kind;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = &kind, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return 0;
+	memcpy(fd_rtn, CMSG_DATA(cmsg), sizeof(int));
+	return kind;
+}
+
+// Take the listening sockets over from the process serving handoff_path. That process stops accepting, drains its
+// connections and closes its store first, so this blocks for up to its drain timeout; clients meanwhile wait in the
+// backlog of the sockets, which stay open throughout. Returns the number of listening sockets received: 0 when no
+// process serves the path
+static long receive_listeners (int *fds)
+{
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, handoff_path, sizeof(sun.sun_path) - 1);
+	int hs = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (hs == -1 || connect(hs, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+	{
+		if (hs != -1)
+			close(hs);
+		return 0; // first start
+	}
+	long count = 0;
+	int rfd;
+	char kind;
+	while ((kind = recv_fd(hs, &rfd)) != 0)
+	{
+		if (kind == HANDOFF_LISTENER && count < LISTENERS_MAX)
+			fds[count++] = rfd;
+		else if (kind == HANDOFF_UNIX && usfd == -1)
+			usfd = rfd;
+		else
+			close(rfd);
+	}
+	close(hs);
+	aesd_log(LOG_INFO, "Took %ld listening sockets over through %s", count, handoff_path);
+	return count;
+}
+
+// Pass every listening socket to the process that connected to hfd. Called once the connections are drained and the
+// store is closed
+static void hand_off (const struct listener *listeners)
+{
+	int cfd = accept(hfd, NULL, NULL);
+	unlink(handoff_path); // the new process binds it once it has the sockets
+	close(hfd);
+	hfd = -1;
+	if (cfd == -1)
+	{
+		aesd_log(LOG_ERR, "Failure to accept the handoff: %s", strerror(errno));
+		return;
+	}
+	bool ok = true;
+	for (long i = 0; i < listener_count && ok; i++)
+		ok = listeners[i].sock_fd == -1 || send_fd(cfd, HANDOFF_LISTENER, listeners[i].sock_fd) == 0;
+	if (ok && usfd != -1)
+		ok = send_fd(cfd, HANDOFF_UNIX, usfd) == 0;
+	if (ok == false)
+		aesd_log(LOG_ERR, "Failure to hand the listening sockets over: %s", strerror(errno));
+	close(cfd);
+}
+
+// `path` made absolute, since a daemon runs from /. Leaked: it lives as long as the process
+static const char *absolute_path (const char *path)
+{
+	char cwd[4096];
+	if (path == NULL || path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+		return path;
+	char *abs = (char *) malloc(strlen(cwd) + strlen(path) + 2);
+	if (abs == NULL)
+		return path;
+	sprintf(abs, "%s/%s", cwd, path);
+	return abs;
+}
+
+// Detach from the terminal: fork, setsid, fork again so that the daemon can never acquire a controlling terminal,
+// then run from / with the standard streams on /dev/null. The foreground process only exits once the daemon is ready,
+// with 0, or with 1 if the daemon died before it got there, so that the caller knows whether startup worked
+static void daemonize (void)
+{
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1)
 		exit(-1);
+	pid_t pid = fork();
+	if (pid == -1)
+		exit(-1);
+	if (pid != 0)
+	{
+		close(p[1]);
+		char ready;
+		ssize_t n;
+		while ((n = read(p[0], &ready, 1)) == -1 && errno == EINTR)
+			;
+		_exit(n == 1 ? 0 : 1); // EOF: every copy of the write end is gone, so the daemon is
+	}
+	close(p[0]);
+	setsid();
+	pid = fork();
+	if (pid == -1)
+		exit(-1);
+	if (pid != 0)
+		_exit(0); // session leader
+	unix_path = absolute_path(unix_path);
+	handoff_path = absolute_path(handoff_path);
+	pidfile = absolute_path(pidfile);
+	if (metrics_where != NULL && strchr(metrics_where, '/') != NULL)
+		metrics_where = absolute_path(metrics_where);
+	if (chdir("/") != 0)
+		aesd_log(LOG_ERR, "Failure to chdir to /: %s", strerror(errno));
+	umask(022);
+	int null = open("/dev/null", O_RDWR);
+	if (null != -1)
+	{
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (null > STDERR_FILENO)
+			close(null);
 	}
+	ready_pipe = p[1];
+}
 
-	ret = listen(sfd, 1); // Mark socket as a listening socket
-	if (ret == -1)
+// Send a state change to the service manager when it asked for them (systemd Type=notify): one datagram to the Unix
+// socket named by NOTIFY_SOCKET, abstract when it starts with '@'
+static void sd_notify_msg (const char *msg)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun;
+	if (path == NULL || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(sun.sun_path))
+		return;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, strlen(path));
+	if (path[0] == '@')
+		sun.sun_path[0] = '\0';
+	int ns = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ns == -1)
+		return;
+	if (sendto(ns, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *) &sun,
+		offsetof(struct sockaddr_un, sun_path) + strlen(path)) == -1)
+		aesd_log(LOG_ERR, "Failure to notify %s: %s", path, strerror(errno));
+	close(ns);
+}
+
+// Everything is set up: listening sockets bound, store open, metrics served. Connections that arrive before the
+// event loop runs wait in the backlog, so traffic may start now
+static void notify_ready (void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long us = (now.tv_sec - start_time.tv_sec) * 1000000 + (now.tv_nsec - start_time.tv_nsec) / 1000;
+	aesd_log(LOG_INFO, "Ready in %ld.%03ld ms", us / 1000, us % 1000);
+	if (pidfile != NULL)
 	{
-		freeaddrinfo(skaddr_ptr);
-		syslog(LOG_USER | LOG_ERR, "Failure to listen");
+		FILE *f = fopen(pidfile, "we");
+		if (f != NULL)
+		{
+			fprintf(f, "%d\n", (int) getpid());
+			fclose(f);
+		}
+		else
+			aesd_log(LOG_ERR, "Failure to write pidfile %s: %s", pidfile, strerror(errno));
+	}
+	char msg[128];
+	snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%d\nSTATUS=Ready in %ld.%03ld ms", (int) getpid(), us / 1000, us % 1000);
+	sd_notify_msg(msg);
+	if (ready_pipe != -1)
+	{
+		ssize_t ret = write(ready_pipe, "r", 1);
+		(void) ret;
+		close(ready_pipe);
+		ready_pipe = -1;
+	}
+}
+
+// Delete the pidfile, unless a process that took over through -H already rewrote it
+static void remove_pidfile (void)
+{
+	FILE *f = pidfile != NULL ? fopen(pidfile, "re") : NULL;
+	if (f == NULL)
+		return;
+	int pid = 0;
+	if (fscanf(f, "%d", &pid) == 1 && pid == (int) getpid())
+		unlink(pidfile);
+	fclose(f);
+}
+
+int main (int argc, char **argv)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	openlog("aesdsocket", LOG_PID, LOG_USER); // Initialize syslog
+	// SIGINT and SIGTERM are never handled asynchronously: they stay blocked in every thread, which inherit the mask
+	// from main, and the event loop reads them from sigfd
+	sigset_t term;
+	sigemptyset(&term);
+	sigaddset(&term, SIGINT);
+	sigaddset(&term, SIGTERM);
+	sigprocmask(SIG_BLOCK, &term, NULL);
+	sigfd = signalfd(-1, &term, SFD_CLOEXEC); // blocking: the ring engine reads it like tfd
+	if (sigfd == -1)
+	{
+		aesd_log(LOG_ERR, "Failure to create signalfd: %s", strerror(errno));
 		exit(-1);
 	}
 
-	// Fork as a daemon when the '-d' argument is given
+	// Preallocate the connection table. One slot per possible fd, so that finding the slot of a connection is O(1)
+	struct rlimit rl;
+	conn_table_len = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ? rl.rlim_cur : CONN_TABLE_MAX;
+	if (conn_table_len > CONN_TABLE_MAX)
+		conn_table_len = CONN_TABLE_MAX;
+	conn_table = (struct conn *) calloc(conn_table_len, sizeof(struct conn)); // all CONN_FREE
+	if (conn_table == NULL)
+	{
+		aesd_log(LOG_ERR, "Failure to allocate the connection table");
+		exit(-1);
+	}
+
+	// Fork as a daemon when the '-d' argument is given. Serve connections from io_uring when '-u' is given
+	// Keep connections open for more packets when '-k' is given
+	// Evict clients that wait more than '-t' seconds between packets, or stall reading their replies for '-w' seconds
+	// Clients may queue '-q' bytes of replies behind the one being sent, then '-Q' drop|disconnect|skip applies
+	// Accept on '-l' listening sockets (0: one per core) with a backlog of '-b', bound to '-a' address (default: any,
+	// IPv6 and IPv4) and '-p' port, plus a Unix domain socket at '-U' path. '-c' reads these from a config file; the
+	// options are applied in order, so whatever comes later on the command line wins
+	// '-s' picks the storage backend: file, chardev, ring or ring-lz4
+	// '-L' drops the log records less severe than a level (default: debug), '-R' caps them to a rate per second
+	// '-M' serves the metrics in the Prometheus text format on a port of 127.0.0.1, or on a Unix socket when it is a path
+	// On SIGINT / SIGTERM the connections get '-g' seconds (default 5) to finish the packets they received
+	// '-H' path: hot restart. A process started with the same path takes the listening sockets over from the one
+	// running, which drains its connections and exits
+	// '-P' writes the pid to a file once the server is ready. With '-d' the foreground process exits at that point;
+	// NOTIFY_SOCKET (systemd Type=notify) is told as well
 	bool is_daemon = false;
+	bool use_uring = false;
+	set_store(STORE_DEFAULT);
 	char c;
- 	while ((c = getopt(argc, argv, "d::")) != (char) -1) // infinite loop if no char cast is there
+ 	while ((c = getopt(argc, argv, "d::ukt:w:q:Q:l:b:a:p:U:c:s:L:R:M:g:H:P:")) != (char) -1) // infinite loop if no char cast is there
  	{
  		switch (c)
  		{
  		case 'd':
  			is_daemon = true;
  			break;
+ 		case 'k':
+ 			keep_alive = true;
+ 			break;
+ 		case 'u':
+ 			use_uring = true;
+ 			break;
+ 		case 't':
+ 			idle_timeout = strtoul(optarg, NULL, 10);
+ 			break;
+ 		case 'w':
+ 			send_timeout = strtoul(optarg, NULL, 10);
+ 			break;
+ 		case 'q':
+ 			outq_budget = strtoull(optarg, NULL, 10);
+ 			break;
+ 		case 'Q':
+ 			if (strcmp(optarg, "drop") == 0)
+ 				outq_policy = OUTQ_DROP;
+ 			else if (strcmp(optarg, "skip") == 0)
+ 				outq_policy = OUTQ_SKIP;
+ 			else
+ 				outq_policy = OUTQ_DISCONNECT;
+ 			break;
+ 		case 'l':
+ 			listener_count = strtol(optarg, NULL, 10);
+ 			break;
+ 		case 'b':
+ 			listen_backlog = atoi(optarg);
+ 			break;
+ 		case 'a':
+ 			bind_address = optarg;
+ 			break;
+ 		case 'p':
+ 			bind_port = optarg;
+ 			break;
+ 		case 'U':
+ 			unix_path = optarg;
+ 			break;
+ 		case 'c':
+ 			load_config(optarg);
+ 			break;
+ 		case 's':
+ 			set_store(optarg);
+ 			break;
+ 		case 'L':
+ 			log_level = parse_log_level(optarg);
+ 			break;
+ 		case 'R':
+ 			log_rate = strtoul(optarg, NULL, 10);
+ 			break;
+ 		case 'M':
+ 			metrics_where = optarg;
+ 			break;
+ 		case 'g':
+ 			drain_timeout = strtoul(optarg, NULL, 10);
+ 			break;
+ 		case 'H':
+ 			handoff_path = optarg;
+ 			break;
+ 		case 'P':
+ 			pidfile = optarg;
+ 			break;
  		default:
  			break;
  		}
  	}
 
-	if (is_daemon)
+	// Open the listening stream sockets. Return -1 if any connection steps fail
+	// With more than one listener every socket sets SO_REUSEPORT and gets a thread of its own; main keeps the first
+	// With -H they are taken over from the process running, if any, whatever -l says
+	int *inherited = (int *) malloc(LISTENERS_MAX * sizeof(int));
+	long inherited_count = (handoff_path != NULL && inherited != NULL) ? receive_listeners(inherited) : 0;
+	if (inherited_count > 0)
+		listener_count = inherited_count;
+	if (usfd != -1 && unix_path == NULL)
 	{
-		// Fork as a new process and quit this foreground process
-		pid_t p = fork();
-		if (p == -1)
-		{
-			// Error
-			exit(-1);
-		}
-		else if (p != 0)
-		{
-			// Parent
-			exit(0);
-		}
-		// Child process continues to the while loop
+		close(usfd); // not wanted any more
+		usfd = -1;
+	}
+	if (listener_count <= 0)
+		listener_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (listener_count <= 0)
+		listener_count = 1;
+	else if (listener_count > LISTENERS_MAX)
+		listener_count = LISTENERS_MAX;
+	struct listener *listeners = (struct listener *) calloc(listener_count, sizeof(struct listener));
+	if (listeners == NULL)
+	{
+		aesd_log(LOG_ERR, "Failure to allocate the listeners");
+		exit(-1);
+	}
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < listener_count; i++)
+		listeners[i].cpu = ncpu > 0 ? i % ncpu : 0;
+	for (long i = 0; i < inherited_count; i++)
+		listeners[i].sock_fd = inherited[i];
+	free(inherited);
+	if (inherited_count == 0 && open_listeners(listeners) != 0)
+		exit(-1);
+	sfd = listeners[0].sock_fd;
+	if (unix_path != NULL && usfd == -1 && (usfd = open_unix_listener(unix_path)) == -1)
+	{
+		aesd_log(LOG_ERR, "Failure to set up the Unix domain socket %s: %s", unix_path, strerror(errno));
+		exit(-1);
 	}
 
-#ifndef USE_AESD_CHAR_DEVICE
-	// Initialize the timer after fork
-	struct sigevent sev;
-	struct itimerspec its;
-	timer_t timerid;
+	// Everything that may fail on a bad option or a busy port failed by now, in the foreground
+	if (is_daemon)
+		daemonize();
 
-	memset(&sev, 0, sizeof(struct sigevent)); // valgrind error about uninitialized sev
-	sev.sigev_notify = SIGEV_THREAD;
-	sev.sigev_notify_function = add_timestamp;
+	// Start logging from the background thread after fork
+	aesd_log_set(log_level, log_rate);
+	if (aesd_log_start() != 0)
+		aesd_log(LOG_ERR, "Failure to start the logging thread. Logging synchronously");
 
-	its.it_value.tv_sec = 10;
+	// Initialize the timer wheel after fork
+	pthread_mutex_init(&wheel_m, NULL);
+	aesd_timer_wheel_init(&wheel, wheel_tick_now());
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec its;
+	its.it_value.tv_sec = 1;
 	its.it_value.tv_nsec = 0;
-	its.it_interval.tv_sec = 10; // repeat interval
+	its.it_interval.tv_sec = 1; // one tick per second
 	its.it_interval.tv_nsec = 0;
-	if (timer_create(CLOCK_REALTIME, &sev, &timerid) != 0)
+	if (tfd == -1 || timerfd_settime(tfd, 0, &its, NULL) != 0)
 	{
-		syslog(LOG_USER | LOG_ERR, "Failure to create timer: %s", strerror(errno));
+		aesd_log(LOG_ERR, "Failure to create timer: %s", strerror(errno));
 	}
-	if (timer_settime(timerid, 0, &its, NULL) != 0)
+	if (store->timestamps)
 	{
-		syslog(LOG_USER | LOG_ERR, "Failure to set timer: %s", strerror(errno));
+		memset(&timestamp_timer, 0, sizeof(timestamp_timer));
+		timestamp_timer.fn = timestamp_timer_fn;
+		aesd_timer_add(&wheel, &timestamp_timer, wheel_tick_now() + TIMESTAMP_INTERVAL);
 	}
-#endif
 
-	fd = open(FILE_NAME, O_APPEND | O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
 	pthread_mutex_init(&fd_m, NULL);
-	if (fd == -1)
+	if (store->open() != 0)
 	{
-		freeaddrinfo(skaddr_ptr);
-		syslog(LOG_USER | LOG_ERR, "Failure to open file %s. Error: %s", FILE_NAME, strerror(errno));
+		aesd_log(LOG_ERR, "Failure to open %s store %s. Error: %s", store->name, store->path, strerror(errno));
 		exit(1);
 	}
 
-	syslog(LOG_USER | LOG_INFO, "Setup successful");
+	// Metrics after fork too: they have a thread of their own
+	if (metrics_where != NULL && metrics_start(metrics_where) != 0)
+		aesd_log(LOG_ERR, "Failure to serve metrics on %s: %s", metrics_where, strerror(errno));
 
-	// Continuously listen for conn until SIGINT / SIGTERM is received. Then log "Caught signal, exiting" and "Closed connection from X.X.X.X" when SIGINT / SIGTERM is received
-	int cfd = -1;
-	while (is_terminated == false)
+	// Only now is this process ready to take over from: its store is open
+	if (handoff_path != NULL && (hfd = open_unix_listener(handoff_path)) == -1)
+		aesd_log(LOG_ERR, "Failure to set up the handoff socket %s: %s", handoff_path, strerror(errno));
+
+	aesd_log(LOG_INFO, "Setup successful");
+	notify_ready();
+
+	if (use_uring && listener_count > 1)
 	{
-		socklen_t inc_sock_size = sizeof(struct sockaddr);
-		cfd = accept(sfd, (struct sockaddr *)&inc_sock, &inc_sock_size);
-		if (cfd < 0)
+		// The ring serves the first socket only. Sockets left in the SO_REUSEPORT group would be handed connections
+		aesd_log(LOG_ERR, "The io_uring engine accepts on a single listening socket. Ignoring -l");
+		for (long i = 1; i < listener_count; i++)
 		{
-			// Error connecting
-			syslog(LOG_USER | LOG_ERR, "Failure to accept connection: %s", strerror(errno));
-			continue;
+			close(listeners[i].sock_fd);
+			listeners[i].sock_fd = -1;
 		}
+		listener_count = 1;
+	}
+#ifdef USE_IO_URING
+	if (use_uring && uring_engine_run() == 0)
+		is_terminated = true; // the ring engine only returns once terminated and drained
+	else if (use_uring)
+		aesd_log(LOG_ERR, "io_uring engine unavailable. Falling back to a thread per connection");
+#else
+	if (use_uring)
+		aesd_log(LOG_ERR, "Built without USE_IO_URING. Falling back to a thread per connection");
+#endif
 
-		struct node *n_new = (struct node *) malloc(sizeof(struct node)); // malloc a new struct to append to the end of the linked list
-		n_new->is_completed = false;
-		// TODO: What happens if malloc fails?
-		pthread_mutex_init(&n_new->ll_m, NULL); // init the mutex with default attr
-		pthread_mutex_lock(&n_new->ll_m); // mutex will be unlocked after the node is appended to the linked list
-		n_new->sock_fd = cfd;
-		inet_ntop(AF_INET, &(inc_sock.sin_addr), n_new->ip_a, INET_ADDRSTRLEN);
-		syslog(LOG_USER | LOG_INFO, "Accepted connection from %s", inet_ntoa(inc_sock.sin_addr));
-		struct node *n_tmp = NULL;
-		struct node *n_tmp_2 = NULL; // n_tmp_2 is a placeholder for SLIST_FOREACH_SAFE
-		struct node *n_tmp_prev = NULL; // to keep track of where to insert n_new
-		SLIST_FOREACH_SAFE(n_tmp, &head, next, n_tmp_2) // Iterate through the struct and pthread_join all completed threads
+	// Start the additional listeners. stop_efd wakes them up at exit: shutting their sockets down would also break
+	// them for a process they are handed over to
+	stop_efd = eventfd(0, EFD_CLOEXEC);
+	if (listener_count > 1)
+	{
+		pin_to_cpu(pthread_self(), listeners[0].cpu);
+		for (long i = 1; i < listener_count; i++)
 		{
-			pthread_mutex_lock(&n_tmp->ll_m);
-			if (n_tmp->is_completed == false)
+			if (pthread_create(&listeners[i].t_id, NULL, listener_func, &listeners[i]) != 0)
 			{
-				pthread_mutex_unlock(&n_tmp->ll_m); // nothing to do. unlock mutex and move on
-				n_tmp_prev = n_tmp; // keep track of the tail-most remaining node
-				continue;
+				aesd_log(LOG_ERR, "Failure to create listener %ld: %s", i, strerror(errno));
+				close(listeners[i].sock_fd);
+				listeners[i].sock_fd = -1;
 			}
-			pthread_join(n_tmp->t_id, NULL); // join thread
-			// TODO: what if pthread_join fails?
-			SLIST_REMOVE(&head, n_tmp, node, next); // remove node n_tmp
-			pthread_mutex_unlock(&n_tmp->ll_m);
-			pthread_mutex_destroy(&n_tmp->ll_m); // destroying a locked mutex results in undefined behavior
-			free(n_tmp); // free node
 		}
-		// After the loop ends, n_tmp_prev should point to the end of the list
-		pthread_create(&n_new->t_id, NULL, thread_func, (void *) n_new); // New default thread for the new connection
-		if (SLIST_EMPTY(&head))
-			SLIST_INSERT_HEAD(&head, n_new, next); // First entry
-		else
-			SLIST_INSERT_AFTER(n_tmp_prev, n_new, next); // Not first entry
-		pthread_mutex_unlock(&n_new->ll_m); // unlock mutex for the new thread to do its work
 	}
-#ifndef USE_AESD_CHAR_DEVICE
-	if (timer_delete(timerid) != 0) // delete the timer
-		syslog(LOG_USER | LOG_ERR, "Error deleting timer: %s", strerror(errno));
-#endif
-	syslog(LOG_USER | LOG_NOTICE, "Caught signal, exiting");
-	struct node *n = NULL;
-	struct node *n_2 = NULL;
-	SLIST_FOREACH_SAFE(n, &head, next, n_2) // Iterate through the struct and pthread_join all completed threads
+
+	// Continuously listen for conn until SIGINT / SIGTERM is received. Then log "Caught signal, exiting" and "Closed connection from X.X.X.X" when SIGINT / SIGTERM is received
+	// poll skips the entries whose fd is -1
+	reap_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct pollfd pfds[6] = { { .fd = sfd, .events = POLLIN }, { .fd = tfd, .events = POLLIN }, { .fd = usfd, .events = POLLIN },
+		{ .fd = reap_efd, .events = POLLIN }, { .fd = sigfd, .events = POLLIN }, { .fd = hfd, .events = POLLIN } };
+	while (is_terminated == false)
+	{
+		// Event loop: wait for a connection, a timer tick, a finished connection, a signal or a handoff
+		if (poll(pfds, 6, -1) == -1)
+			continue;
+		if (pfds[4].revents & POLLIN)
+			handle_sigfd();
+		if (pfds[5].revents & POLLIN)
+			is_handoff = is_terminated = true; // accepted once the connections are drained
+		if (is_terminated)
+			break;
+		if (pfds[1].revents & POLLIN)
+		{
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+				timers_advance();
+		}
+		if (pfds[3].revents & POLLIN)
+		{
+			uint64_t completions;
+			ssize_t ret = read(reap_efd, &completions, sizeof(completions));
+			(void) ret;
+		}
+		reap_conns(); // O(finished connections)
+		if (pfds[0].revents & POLLIN)
+			accept_conn(sfd);
+		if (pfds[2].revents & POLLIN)
+			accept_conn(usfd);
+	}
+	// Wake the other listeners up and wait for them, so that no connection is accepted past this point. The
+	// listening sockets stay open: clients that connect from now on wait in their backlog
+	uint64_t one = 1;
+	ssize_t ret = write(stop_efd, &one, sizeof(one));
+	(void) ret;
+	for (long i = 1; i < listener_count; i++)
 	{
-		pthread_cancel(n->t_id);
-		pthread_join(n->t_id, NULL); // join thread
-		// TODO: what if pthread_join fails?
-		SLIST_REMOVE(&head, n, node, next); // remove node n_tmp
-		pthread_mutex_unlock(&n->ll_m);
-		pthread_mutex_destroy(&n->ll_m); // destroying a locked mutex results in undefined behavior
-		free(n); // free node
+		if (listeners[i].sock_fd != -1)
+			pthread_join(listeners[i].t_id, NULL);
 	}
-	freeaddrinfo(skaddr_ptr);
+	if (is_handoff)
+		aesd_log(LOG_NOTICE, "Handing over to a new process, exiting");
+	else
+		aesd_log(LOG_NOTICE, "Caught signal, exiting");
+	sd_notify_msg("STOPPING=1");
+	drain_conns();
+	close(tfd); // delete the timer
+	free(conn_table);
+	close(reap_efd);
+	close(stop_efd);
+	metrics_stop();
+	pthread_mutex_lock(&fd_m);
+	store->close(is_handoff);
+	pthread_mutex_unlock(&fd_m);
+	if (is_handoff)
+		hand_off(listeners);
+	else if (hfd != -1)
+	{
+		close(hfd);
+		unlink(handoff_path);
+	}
+	for (long i = 0; i < listener_count; i++)
+	{
+		if (listeners[i].sock_fd != -1)
+			close(listeners[i].sock_fd);
+	}
+	free(listeners);
+	if (usfd != -1)
+	{
+		close(usfd);
+		if (is_handoff == false)
+			unlink(unix_path);
+	}
+	remove_pidfile();
 }
 
 void *thread_func (void *arg) 
 {
 	pthread_cleanup_push(thread_cleanup, arg);
-	struct node *n = (struct node *) arg; // to shut the compiler up about incompatible arg type
-	// n: addr to the linked list node corresponding to this thread
-	pthread_mutex_lock(&n->ll_m); // Lock node mutex
-	// Receive data from the conn, and append it to file `/var/tmp/aesdsocketdata`. Discard over-length packets (ie if malloc fails)
-
-	char *buf = (char *)malloc(200); // arbitrary 200 byte buffer
-	memset(buf, 0, 200);
-	size_t len = 0;
-	char c;
-	while (recv(n->sock_fd, &c, 1, 0) == 1 && len < 200)
-	{
-		*(buf+len) = c; // copy to buffer
-		len++;
-		if (c == '\n')
-			break; // end of packet received
-	}
-	pthread_mutex_lock(&fd_m);
-	ssize_t write_ret_val = write(fd, buf, strlen(buf)); // ignore failure to write
-	(void) write_ret_val; // Explicitly ignore returned value to get rid of the "-Werror=unused-result" error
-	pthread_mutex_unlock(&fd_m);
-	free(buf);
+	struct conn *n = (struct conn *) arg; // to shut the compiler up about incompatible arg type
+	// n: addr to the connection table slot corresponding to this thread
+	// Receive data from the conn, and append it to file `/var/tmp/aesdsocketdata`. Over-length packets are truncated
+	// Without -k the connection carries a single packet. With -k it carries packets until the client closes it, and
+	// packets may be pipelined: everything already received is parsed before waiting for more
 
-	pthread_mutex_lock(&fd_m);
-	lseek(fd, SEEK_SET, 0); // start at the front of the file
-	while(read(fd, &c, 1) == 1)
+	// Replies are queued and sent as the socket becomes writable, so a client can keep pipelining packets while it
+	// reads the replies of the previous ones. A client that stalls holds up nobody but itself
+
+	// A client whose first byte is NUL sends records instead (aesd_record.h), taken the same way: one per connection
+	// without -k. Their payloads are received in place and never scanned
+
+	char pkt[PKT_MAX];
+	char rx[4096]; // receive in large chunks instead of a recv per byte
+	struct pkt_parser p = { .buf = pkt, .len = 0, .discarding = false };
+	struct record_rx rec = { .hdr_got = 0, .payload = NULL };
+	bool is_new = true; // nothing received yet
+	bool is_reading = true; // false once the connection carries no more packets
+	bool is_open = true;
+	bool progress = true; // a packet was handled or reply bytes were sent: push the deadline back
+	bool was_sending = false;
+	while (is_open && (is_reading || n->outq.count > 0))
 	{
-		// Return the FULL content of `/var/tmp/aesdsocketdata` to the client as soon as a new packet is received (delimited by '\n')
-		send(n->sock_fd, &c, 1, 0);
+		bool is_sending = n->outq.count > 0;
+		if (progress || is_sending != was_sending)
+			conn_timer_arm(&n->timer, is_sending ? send_timeout : idle_timeout); // the client stalls, or is idle
+		progress = false;
+		was_sending = is_sending;
+
+		struct pollfd pfd = { .fd = n->sock_fd, .events = (is_reading ? POLLIN : 0) | (is_sending ? POLLOUT : 0) };
+		if (poll(&pfd, 1, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (is_sending && (pfd.revents & (POLLOUT | POLLERR | POLLHUP)))
+			is_open = outq_flush(&n->outq, n->sock_fd, &progress);
+		if (is_open == false || is_reading == false || (pfd.revents & (POLLIN | POLLERR | POLLHUP)) == 0)
+			continue;
+
+		bool in_place = rec.payload != NULL; // the rest of a record payload goes straight where it belongs
+		ssize_t r = in_place ? recv(n->sock_fd, rec.payload + rec.got, rec.len - rec.got, MSG_DONTWAIT)
+			: recv(n->sock_fd, rx, sizeof(rx), MSG_DONTWAIT);
+		if (r == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		if (r > 0)
+			metric_add(M_BYTES_IN, r);
+		if (r <= 0)
+		{
+			// Client closed its end. A trailing unterminated packet still counts, a partial record does not. Queued
+			// replies are still sent. A partial packet cut short by the drain at exit is dropped
+			if (r == 0 && is_terminated == false && n->is_binary == false && (p.len > 0 || keep_alive == false))
+				is_open = handle_packet(n, NULL, pkt, p.len);
+			else if (n->is_binary && rec.hdr_got > 0)
+				aesd_log(LOG_INFO, "Partial record from %s dropped", n->ip_a);
+			is_reading = false;
+			continue;
+		}
+		if (is_new)
+			n->is_binary = rx[0] == '\0';
+		is_new = false;
+		size_t off = in_place ? (size_t) r : 0;
+		if (in_place)
+			rec.got += r;
+		while ((in_place || off < (size_t) r) && is_open)
+		{
+			bool complete = false;
+			if (in_place)
+				complete = rec.got == rec.len;
+			else if (n->is_binary)
+			{
+				ssize_t used = record_feed(n, &rec, rx + off, r - off, &complete);
+				is_open = used != -1;
+				off += used;
+			}
+			else
+				off += pkt_parse(&p, rx + off, r - off, &complete);
+			in_place = false;
+			if (complete == false)
+				continue; // need more data, or the tail of an over-length packet was skipped
+			is_open = n->is_binary ? record_done(n, &rec) : handle_packet(n, NULL, pkt, p.len);
+			p.len = 0;
+			progress = true;
+			if (keep_alive == false)
+			{
+				is_reading = false; // anything after the first packet is discarded
+				break;
+			}
+		}
 	}
-	pthread_mutex_unlock(&fd_m);
 
-	syslog(LOG_USER | LOG_INFO, "Closed connection from %s", n->ip_a);
+	free(rec.payload);
+	aesd_log_conn(AESD_LOG_CLOSE, n->sock_fd, n->ip_a);
 
 	pthread_cleanup_pop(1); // pop and execute thread_cleanup
 	return NULL; // to shut the compiler up about void*
@@ -0,0 +1,170 @@
+/*
+ * aesdsocket.h
+ *
+ * State shared between aesdsocket.c and the optional connection engines
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h> // is_terminated
+#include <sys/types.h> // ssize_t
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h> // struct iovec
+#include <netinet/in.h> // INET6_ADDRSTRLEN
+
+#include "aesd-timer-wheel.h"
+#include "aesd-log.h"
+#include "aesd_record.h"
+
+#define PKT_MAX 200 // packets longer than this are truncated
+#define PEER_ADDRSTRLEN INET6_ADDRSTRLEN // room for the name of any client, see peer_name
+
+// "AESDSOCKET_DELTA:X\n" switches a connection to delta mode: the client holds the first X bytes of the history, so
+// this reply and every later one only carries data it has not been sent yet. Modelled on "AESDCHAR_IOCSEEKTO:X,Y"
+// A delta mode client over its reply budget with -Q skip has its new reply dropped rather than its queued ones skipped,
+// and with -Q drop as well, the next reply starts where the dropped one did: it never misses a byte
+#define DELTA_CMD "AESDSOCKET_DELTA:"
+
+// "AESDSOCKET_GREP:pattern\n" is replied the lines of the history that contain pattern, and "AESDSOCKET_TAIL:N\n"
+// its last N lines. Neither is stored nor changes what a delta mode connection is sent next
+#define GREP_CMD "AESDSOCKET_GREP:"
+#define TAIL_CMD "AESDSOCKET_TAIL:"
+
+// A connection whose first byte is NUL speaks binary records (aesd_record.h) instead of lines: the magic of the first
+// record is the preamble. Each record is appended to the store as it is, header included, and replied one record whose
+// payload is the history, carrying the seq of the record it answers. A payload that is a DELTA_CMD or a query is
+// handled like the same line, and not stored
+#define RECORD_MAX (1U << 20) // largest payload accepted in a record. A client sending more is disconnected
+
+extern int sfd; // server socket
+extern int usfd; // Unix domain server socket. -1 when there is none
+extern int fd; // fd of the file or device backend. -1 for the ring backend
+extern pthread_mutex_t fd_m; // mutex for the storage backend
+extern size_t data_len; // committed length of the stream of appends. Protected by fd_m
+extern int sigfd; // signalfd of SIGINT and SIGTERM
+extern int hfd; // handoff socket (-H). -1 when there is none
+extern atomic_bool is_terminated; // set once SIGINT / SIGTERM is read from sigfd, or a new process asks for the sockets
+extern bool is_handoff; // a new process connected to hfd and takes over once the connections are drained
+extern unsigned drain_timeout; // seconds the connections have to finish their work once terminated
+extern bool keep_alive; // serve many packets per connection
+extern unsigned idle_timeout; // seconds a connection may wait for its next packet. 0 to disable
+extern unsigned send_timeout; // seconds a client may stall reading its replies before it is evicted. 0 to disable
+extern int tfd; // timerfd ticking the timer wheel once per second
+
+// Assembles newline delimited packets out of a byte stream
+struct pkt_parser
+{
+	char *buf; // PKT_MAX bytes where the packet is assembled
+	size_t len; // bytes of the packet assembled so far
+	bool discarding; // skipping the tail of an over-length packet
+};
+
+// Write the address of a client into `buf` (PEER_ADDRSTRLEN bytes). IPv4 clients of the dual-stack socket are shown
+// as plain IPv4 addresses, and clients of the Unix domain socket as "local"
+void peer_name (const struct sockaddr_storage *ss, char *buf);
+
+// Consume bytes of `data` until a packet is complete. Returns the number of bytes consumed. *complete is set when
+// p->buf holds a whole packet, which is then truncated to PKT_MAX. The caller resets p->len once it is handled
+size_t pkt_parse (struct pkt_parser *p, const char *data, size_t n, bool *complete);
+
+// Returns true and the acknowledged offset if the packet is a DELTA_CMD
+bool parse_delta_cmd (const char *pkt, size_t len, size_t *offset);
+
+// A GREP_CMD or TAIL_CMD, see aesdsocket-query.c
+struct query
+{
+	enum { QUERY_GREP, QUERY_TAIL } kind;
+	char pattern[PKT_MAX]; // QUERY_GREP, matched as a plain string
+	size_t pattern_len;
+	size_t lines; // QUERY_TAIL
+};
+
+// Returns true and fills `q` if the packet is a GREP_CMD or a TAIL_CMD
+bool parse_query_cmd (const char *pkt, size_t len, struct query *q);
+
+// Run `q` over `len` bytes of history. Returns the reply and sets *out_len, or returns NULL when out of memory. The
+// reply is either inside `data`, or a malloc'd buffer that is also returned in *owned for the caller to free
+const char *query_run (const struct query *q, const char *data, size_t len, size_t *out_len, char **owned);
+
+// Connection deadlines. An expired deadline shuts the socket down; the owner must disarm the timer before closing it
+void conn_timer_init (struct aesd_timer *t, int sock);
+void conn_timer_arm (struct aesd_timer *t, unsigned secs); // (re)arm to expire in `secs` seconds. 0 disarms
+void conn_timer_disarm (struct aesd_timer *t);
+
+// Run the timers that expired by now. Called from the event loop each time tfd ticks
+void timers_advance (void);
+
+// A storage backend, see aesdsocket-store.c. Every call is made with fd_m held
+struct store_ops
+{
+	const char *name; // for -s
+	const char *path;
+	bool timestamps; // timestamp records are appended to this backend
+	int (*open) (void); // sets data_len to what the backend already holds. Returns -1 and errno on failure
+	ssize_t (*append) (const char *buf, size_t len); // like write(2)
+	ssize_t (*appendv) (const struct iovec *iov, int iovcnt); // like writev(2), the pieces make one record
+	// Pointer to the first `len` bytes, which stays valid until exit. NULL when the backend cannot be mapped
+	const char *(*map) (size_t len);
+	// malloc'd copy of [from, to). Its start is clamped to the oldest byte still held, so *len may be short of to - from
+	char *(*copy) (size_t from, size_t to, size_t *len);
+	// Bytes held, as appended and as stored. NULL when the backend does not know
+	bool (*occupancy) (size_t *bytes, size_t *stored);
+	void (*close) (bool keep); // and delete what is not meant to outlive the process, unless `keep`: a hot restart
+};
+
+extern const struct store_ops *store; // the backend in use
+extern const struct store_ops store_backends[]; // terminated by a NULL name
+const struct store_ops *store_find (const char *name);
+
+// Return a pointer to the first `len` bytes of the store, or NULL if it cannot be mmapped. Caller holds fd_m
+const char *map_data_file (size_t len);
+
+// Hot path counters, see aesdsocket-metrics.c. Every call is a no-op until metrics_start succeeds
+enum metric
+{
+	M_ACCEPTED, // connections accepted
+	M_CLOSED, // connections closed
+	M_PACKETS, // packets appended
+	M_BYTES_IN, // bytes received
+	M_BYTES_OUT, // bytes sent
+	M_REPLAY_BYTES, // bytes of history queued as replies
+	M_LOCK_WAIT_NS, // nanoseconds spent waiting for fd_m
+	M_LOCK_ACQUIRED, // acquisitions of fd_m
+	M_COUNTERS
+};
+
+enum metric_hist
+{
+	H_APPEND, // append of a packet, lock wait included
+	H_REPLAY, // reply queued to its last byte sent
+	H_COUNT
+};
+
+extern bool metrics_on;
+void metric_add (enum metric m, uint64_t v);
+void metric_observe (enum metric_hist h, uint64_t start_ns); // record the time elapsed since start_ns. 0 is ignored
+uint64_t metrics_now (void); // monotonic nanoseconds. 0 when metrics are off, so that nothing is timed
+void store_lock (void); // lock fd_m and count the time spent waiting for it
+void store_unlock (void);
+
+// Serve the metrics on `where`: a port of 127.0.0.1, or the path of a Unix domain socket when it starts with '/'.
+// Returns -1 and errno on failure
+int metrics_start (const char *where);
+void metrics_stop (void);
+
+#ifdef USE_IO_URING
+// Serve connections on sfd from a single io_uring until is_terminated. Returns -1 without accepting anything if the
+// ring cannot be set up, so that the caller can fall back to the thread-per-connection engine
+int uring_engine_run (void);
+
+// Append a timestamp record through the ring so that it is ordered with the packets it appends. Returns false when
+// the ring engine is not running
+bool uring_append_timestamp (const char *rec, size_t len);
+#endif
+
+#endif /* AESDSOCKET_H */